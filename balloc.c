@@ -0,0 +1,987 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/rbtree.h>
+#include <linux/bitmap.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+/*
+ * Locking
+ *
+ * Each allocation group has its own locks: the inode bitmap of the group and
+ * its summary are protected by grp->ialloc_lock, the block bitmap of the
+ * group, its summary and its free extent tree by grp->balloc_lock. Allocations
+ * in different groups therefore never contend. The total numbers of free
+ * inodes and blocks are per-CPU counters, updated outside of these locks.
+ *
+ * To avoid taking balloc_lock for every block, each CPU keeps a batch of
+ * contiguous blocks claimed from the bitmap but still counted as free. When
+ * blocks are allocated from the bitmap, the blocks right after them are claimed
+ * in the batch of the CPU, so that the next blocks of a file written
+ * sequentially are served from the batch, under its own lock only. Batches are
+ * given back to the bitmap before it is written to disk, and when the bitmap
+ * runs out of free blocks. Lock order: batch->lock, then grp->balloc_lock. At
+ * most one group lock of each kind is held at a time.
+ */
+#define OUICHEFS_BATCH_SIZE 16
+
+int ouichefs_balloc_init(struct ouichefs_sb_info *sbi, uint32_t nr_free_inodes,
+			 uint32_t nr_free_blocks)
+{
+	struct ouichefs_balloc_batch *batch;
+	int cpu, ret;
+
+	ret = percpu_counter_init(&sbi->nr_free_inodes, nr_free_inodes,
+				  GFP_KERNEL);
+	if (ret)
+		return ret;
+	ret = percpu_counter_init(&sbi->nr_free_blocks, nr_free_blocks,
+				  GFP_KERNEL);
+	if (ret)
+		goto destroy_inodes;
+	ret = percpu_counter_init(&sbi->nr_dirty_blocks, 0, GFP_KERNEL);
+	if (ret)
+		goto destroy_blocks;
+	ret = percpu_counter_init(&sbi->prealloc_hits, 0, GFP_KERNEL);
+	if (ret)
+		goto destroy_dirty;
+	ret = percpu_counter_init(&sbi->prealloc_misses, 0, GFP_KERNEL);
+	if (ret)
+		goto destroy_hits;
+	spin_lock_init(&sbi->prealloc_lock);
+	INIT_LIST_HEAD(&sbi->prealloc_inodes);
+
+	sbi->batches = alloc_percpu(struct ouichefs_balloc_batch);
+	if (!sbi->batches) {
+		ret = -ENOMEM;
+		goto destroy_misses;
+	}
+	for_each_possible_cpu(cpu) {
+		batch = per_cpu_ptr(sbi->batches, cpu);
+		spin_lock_init(&batch->lock);
+		batch->start = 0;
+		batch->len = 0;
+	}
+
+	return 0;
+
+destroy_misses:
+	percpu_counter_destroy(&sbi->prealloc_misses);
+destroy_hits:
+	percpu_counter_destroy(&sbi->prealloc_hits);
+destroy_dirty:
+	percpu_counter_destroy(&sbi->nr_dirty_blocks);
+destroy_blocks:
+	percpu_counter_destroy(&sbi->nr_free_blocks);
+destroy_inodes:
+	percpu_counter_destroy(&sbi->nr_free_inodes);
+	return ret;
+}
+
+void ouichefs_balloc_destroy(struct ouichefs_sb_info *sbi)
+{
+	free_percpu(sbi->batches);
+	percpu_counter_destroy(&sbi->prealloc_misses);
+	percpu_counter_destroy(&sbi->prealloc_hits);
+	percpu_counter_destroy(&sbi->nr_dirty_blocks);
+	percpu_counter_destroy(&sbi->nr_free_blocks);
+	percpu_counter_destroy(&sbi->nr_free_inodes);
+}
+
+/*
+ * Initialize the locks, bitmap summaries, free counts and free extent trees of
+ * the allocation groups. The geometry of the groups and their bitmaps must
+ * already be set up (see ouichefs_fill_super()).
+ * Return 0 on success, -ENOMEM if a summary could not be allocated.
+ */
+int ouichefs_groups_init(struct ouichefs_sb_info *sbi)
+{
+	struct ouichefs_group *grp;
+	uint32_t g;
+	int ret;
+
+	for (g = 0; g < sbi->nr_groups; g++) {
+		grp = &sbi->groups[g];
+		spin_lock_init(&grp->ialloc_lock);
+		spin_lock_init(&grp->balloc_lock);
+
+		ret = ouichefs_bitmap_sum_init(&grp->ifree_sum,
+					       grp->ifree_bitmap,
+					       grp->nr_inodes);
+		if (ret)
+			goto destroy;
+		ret = ouichefs_bitmap_sum_init(&grp->bfree_sum,
+					       grp->bfree_bitmap,
+					       grp->nr_blocks);
+		if (ret) {
+			ouichefs_bitmap_sum_destroy(&grp->ifree_sum);
+			goto destroy;
+		}
+
+		grp->nr_free_inodes =
+			bitmap_weight(grp->ifree_bitmap, grp->nr_inodes);
+		grp->nr_free_blocks =
+			bitmap_weight(grp->bfree_bitmap, grp->nr_blocks);
+
+		/* Build the free extent tree, or fall back to the bitmap */
+		if (ouichefs_fext_build(grp))
+			pr_warn("cannot build free extent tree of group %u, using bitmap allocation\n",
+				g);
+	}
+
+	return 0;
+
+destroy:
+	while (g--) {
+		grp = &sbi->groups[g];
+		ouichefs_fext_destroy(grp);
+		ouichefs_bitmap_sum_destroy(&grp->bfree_sum);
+		ouichefs_bitmap_sum_destroy(&grp->ifree_sum);
+	}
+	return ret;
+}
+
+void ouichefs_groups_destroy(struct ouichefs_sb_info *sbi)
+{
+	struct ouichefs_group *grp;
+	uint32_t g;
+
+	for (g = 0; g < sbi->nr_groups; g++) {
+		grp = &sbi->groups[g];
+		ouichefs_fext_destroy(grp);
+		ouichefs_bitmap_sum_destroy(&grp->bfree_sum);
+		ouichefs_bitmap_sum_destroy(&grp->ifree_sum);
+	}
+}
+
+/*
+ * Give blocks [start, start + len[ back to the bitmap of their group.
+ */
+static void put_blocks(struct ouichefs_sb_info *sbi, uint32_t start,
+		       uint32_t len)
+{
+	struct ouichefs_group *grp = ouichefs_block_group(sbi, start);
+
+	spin_lock(&grp->balloc_lock);
+	__put_blocks(grp, start, len);
+	spin_unlock(&grp->balloc_lock);
+}
+
+/*
+ * Give the blocks of all the per-CPU batches back to the block bitmap.
+ */
+void ouichefs_balloc_drain(struct ouichefs_sb_info *sbi)
+{
+	struct ouichefs_balloc_batch *batch;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		batch = per_cpu_ptr(sbi->batches, cpu);
+		spin_lock(&batch->lock);
+		if (batch->len) {
+			put_blocks(sbi, batch->start, batch->len);
+			batch->len = 0;
+		}
+		spin_unlock(&batch->lock);
+	}
+}
+
+/*
+ * Return the number of non-empty per-CPU batches, leaving their blocks in
+ * place: each one is a free extent out of the free extent trees. *largest is
+ * raised to the size of the largest batch.
+ */
+uint32_t ouichefs_balloc_batched(struct ouichefs_sb_info *sbi,
+				 uint32_t *largest)
+{
+	struct ouichefs_balloc_batch *batch;
+	uint32_t nr = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		batch = per_cpu_ptr(sbi->batches, cpu);
+		spin_lock(&batch->lock);
+		if (batch->len) {
+			nr++;
+			*largest = max(*largest, batch->len);
+		}
+		spin_unlock(&batch->lock);
+	}
+
+	return nr;
+}
+
+/*
+ * Choose the group of a new directory: among the groups with at least the
+ * average number of free inodes, the one with the most free blocks, so that
+ * directories, and the files created in them, are spread over the partition.
+ */
+static uint32_t find_group_dir(struct ouichefs_sb_info *sbi, uint32_t parent)
+{
+	uint32_t avg, g, best = parent, best_blocks = 0;
+	struct ouichefs_group *grp;
+
+	avg = percpu_counter_read_positive(&sbi->nr_free_inodes) /
+	      sbi->nr_groups;
+	for (g = 0; g < sbi->nr_groups; g++) {
+		grp = &sbi->groups[g];
+		if (READ_ONCE(grp->nr_free_inodes) < max(avg, 1U))
+			continue;
+		if (READ_ONCE(grp->nr_free_blocks) > best_blocks) {
+			best = g;
+			best_blocks = READ_ONCE(grp->nr_free_blocks);
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Return an unused inode number and mark it used. Regular files are allocated
+ * in the group of their parent directory dir, directories in a group chosen by
+ * find_group_dir(); if this group is full, the next groups are tried. In a
+ * group, the search starts at the roving cursor of the inode bitmap, right
+ * after the last allocated inode.
+ * Return 0 if no free inode was found.
+ */
+uint32_t get_free_inode(struct ouichefs_sb_info *sbi, uint32_t dir,
+			bool is_dir)
+{
+	struct ouichefs_group *grp;
+	uint32_t start, g, ret = 0;
+
+	start = ouichefs_ino_group(sbi, dir) - sbi->groups;
+	if (is_dir)
+		start = find_group_dir(sbi, start);
+
+	for (g = 0; g < sbi->nr_groups && !ret; g++) {
+		grp = &sbi->groups[(start + g) % sbi->nr_groups];
+		if (!READ_ONCE(grp->nr_free_inodes))
+			continue;
+
+		spin_lock(&grp->ialloc_lock);
+		ret = get_first_free_bit(grp->ifree_bitmap, &grp->ifree_sum,
+					 grp->nr_inodes, grp->ifree_sum.cursor);
+		if (ret) {
+			grp->nr_free_inodes--;
+			ret += grp->first_inode;
+		}
+		spin_unlock(&grp->ialloc_lock);
+	}
+
+	if (ret) {
+		percpu_counter_dec(&sbi->nr_free_inodes);
+		pr_debug("allocated inode %u\n", ret);
+	}
+	return ret;
+}
+
+/*
+ * Mark an inode as unused.
+ */
+void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
+{
+	struct ouichefs_group *grp;
+	int ret;
+
+	/* ino is out of ifree_bitmap */
+	if (ino >= sbi->nr_inodes)
+		return;
+
+	grp = ouichefs_ino_group(sbi, ino);
+	spin_lock(&grp->ialloc_lock);
+	ret = put_free_bit(grp->ifree_bitmap, &grp->ifree_sum, grp->nr_inodes,
+			   ino - grp->first_inode);
+	if (!ret)
+		grp->nr_free_inodes++;
+	spin_unlock(&grp->ialloc_lock);
+	if (ret)
+		return;
+
+	percpu_counter_inc(&sbi->nr_free_inodes);
+	pr_debug("freed inode %u\n", ino);
+}
+
+/*
+ * Allocate up to count contiguous unused blocks in a group, and refill the
+ * batch of the current CPU with the blocks following them.
+ * Must be called with batch->lock held.
+ */
+static uint32_t group_get_free_blocks(struct ouichefs_group *grp,
+				      struct ouichefs_balloc_batch *batch,
+				      uint32_t goal, uint32_t count,
+				      uint32_t *got)
+{
+	uint32_t ret, next;
+
+	spin_lock(&grp->balloc_lock);
+	ret = __get_free_blocks(grp, goal, count, got);
+
+	/* Claim the blocks following this allocation in the batch */
+	next = ret + *got;
+	if (ret && *got == count && !batch->len &&
+	    next < grp->first_block + grp->nr_blocks &&
+	    test_bit(next - grp->first_block, grp->bfree_bitmap))
+		batch->start = __get_free_blocks(grp, next, OUICHEFS_BATCH_SIZE,
+						 &batch->len);
+	spin_unlock(&grp->balloc_lock);
+
+	return ret;
+}
+
+/*
+ * Allocate up to count contiguous unused blocks, as close as possible to goal
+ * (see __get_free_blocks()), and mark them used. The group containing goal is
+ * used first, then the next groups. The batch of the current CPU is used if it
+ * starts at goal, i.e. if it continues the file being written.
+ * The number of allocated blocks is stored in got.
+ * Return the first allocated block number, or 0 if no free block was found.
+ */
+uint32_t get_free_blocks(struct ouichefs_sb_info *sbi, uint32_t goal,
+			 uint32_t count, uint32_t *got)
+{
+	struct ouichefs_balloc_batch *batch;
+	struct ouichefs_group *grp;
+	bool drained = false;
+	uint32_t ret = 0, start, g;
+
+	if (goal >= sbi->nr_blocks)
+		goal = 0;
+	start = ouichefs_block_group(sbi, goal) - sbi->groups;
+
+retry:
+	*got = 0;
+	batch = raw_cpu_ptr(sbi->batches);
+	spin_lock(&batch->lock);
+
+	if (batch->len && (!goal || goal == batch->start)) {
+		ret = batch->start;
+		*got = min(count, batch->len);
+		batch->start += *got;
+		batch->len -= *got;
+		goto unlock_batch;
+	}
+
+	/* The batch does not continue this file, give it back */
+	if (batch->len) {
+		put_blocks(sbi, batch->start, batch->len);
+		batch->len = 0;
+	}
+
+	for (g = 0; g < sbi->nr_groups && !ret; g++) {
+		grp = &sbi->groups[(start + g) % sbi->nr_groups];
+		if (!READ_ONCE(grp->nr_free_blocks))
+			continue;
+		ret = group_get_free_blocks(grp, batch, g ? 0 : goal, count,
+					    got);
+	}
+
+unlock_batch:
+	spin_unlock(&batch->lock);
+
+	/*
+	 * The last free blocks may be held in the batches of other CPUs or in
+	 * the preallocation windows of inodes
+	 */
+	if (!ret && !drained &&
+	    percpu_counter_sum_positive(&sbi->nr_free_blocks)) {
+		ouichefs_balloc_drain(sbi);
+		ouichefs_prealloc_drain(sbi);
+		drained = true;
+		goto retry;
+	}
+
+	if (ret) {
+		percpu_counter_sub(&sbi->nr_free_blocks, *got);
+		pr_debug("allocated blocks %u-%u\n", ret, ret + *got - 1);
+	}
+	return ret;
+}
+
+/*
+ * Mark a block as unused.
+ */
+void put_block(struct ouichefs_sb_info *sbi, uint32_t bno)
+{
+	struct ouichefs_group *grp;
+
+	/* bno is out of bfree_bitmap */
+	if (bno >= sbi->nr_blocks)
+		return;
+
+	grp = ouichefs_block_group(sbi, bno);
+	spin_lock(&grp->balloc_lock);
+	/* Do not free a block twice, it would corrupt the free extent tree */
+	if (test_bit(bno - grp->first_block, grp->bfree_bitmap)) {
+		spin_unlock(&grp->balloc_lock);
+		pr_warn("block %u is already free\n", bno);
+		return;
+	}
+	__put_blocks(grp, bno, 1);
+	spin_unlock(&grp->balloc_lock);
+
+	percpu_counter_inc(&sbi->nr_free_blocks);
+	pr_debug("freed block %u\n", bno);
+}
+
+/*
+ * Preallocation windows
+ *
+ * Each inode keeps a window of contiguous blocks following its last allocated
+ * block. Like the per-CPU batches, the blocks of a window are claimed from the
+ * bitmap but still counted as free. When the next blocks of the file are
+ * allocated, they are taken from the window if it starts at the goal, so that
+ * files appended to concurrently stay contiguous. Otherwise, the window is
+ * given back and the allocation claims a new one after the allocated blocks.
+ * Windows are given back when their file is closed, when their inode is
+ * evicted (e.g. under memory pressure), before the bitmap is written to disk,
+ * and when the bitmap runs out of free blocks.
+ * Lock order: sbi->prealloc_lock, then ci->prealloc_lock.
+ */
+#define OUICHEFS_PREALLOC_BLOCKS 8
+
+void ouichefs_prealloc_init(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	spin_lock_init(&ci->prealloc_lock);
+	ci->prealloc_start = 0;
+	ci->prealloc_len = 0;
+	INIT_LIST_HEAD(&ci->prealloc_list);
+}
+
+/*
+ * Give the preallocation window of an inode back to the bitmap.
+ */
+void ouichefs_prealloc_discard(struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t start, len;
+
+	spin_lock(&sbi->prealloc_lock);
+	spin_lock(&ci->prealloc_lock);
+	start = ci->prealloc_start;
+	len = ci->prealloc_len;
+	ci->prealloc_len = 0;
+	list_del_init(&ci->prealloc_list);
+	spin_unlock(&ci->prealloc_lock);
+	spin_unlock(&sbi->prealloc_lock);
+
+	if (len)
+		put_blocks(sbi, start, len);
+}
+
+/*
+ * Give the preallocation windows of all inodes back to the bitmap.
+ */
+void ouichefs_prealloc_drain(struct ouichefs_sb_info *sbi)
+{
+	struct ouichefs_inode_info *ci, *tmp;
+
+	spin_lock(&sbi->prealloc_lock);
+	list_for_each_entry_safe(ci, tmp, &sbi->prealloc_inodes,
+				 prealloc_list) {
+		spin_lock(&ci->prealloc_lock);
+		if (ci->prealloc_len)
+			put_blocks(sbi, ci->prealloc_start, ci->prealloc_len);
+		ci->prealloc_len = 0;
+		list_del_init(&ci->prealloc_list);
+		spin_unlock(&ci->prealloc_lock);
+	}
+	spin_unlock(&sbi->prealloc_lock);
+}
+
+/*
+ * Allocate up to count contiguous unused blocks for the file of inode, as
+ * close as possible to goal (see get_free_blocks()). The preallocation window
+ * of the inode is used if it starts at goal. Otherwise, it is replaced by the
+ * blocks following the allocated ones.
+ * The number of allocated blocks is stored in got.
+ * Return the first allocated block number, or 0 if no free block was found.
+ */
+uint32_t get_free_file_blocks(struct inode *inode, uint32_t goal,
+			      uint32_t count, uint32_t *got)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t ret, len;
+
+	spin_lock(&ci->prealloc_lock);
+	if (ci->prealloc_len && goal == ci->prealloc_start) {
+		ret = ci->prealloc_start;
+		*got = min(count, ci->prealloc_len);
+		ci->prealloc_start += *got;
+		ci->prealloc_len -= *got;
+		spin_unlock(&ci->prealloc_lock);
+
+		percpu_counter_sub(&sbi->nr_free_blocks, *got);
+		percpu_counter_inc(&sbi->prealloc_hits);
+		return ret;
+	}
+	spin_unlock(&ci->prealloc_lock);
+
+	/* The window does not continue the file, give it back */
+	ouichefs_prealloc_discard(inode);
+
+	percpu_counter_inc(&sbi->prealloc_misses);
+	ret = get_free_blocks(sbi, goal, count + OUICHEFS_PREALLOC_BLOCKS,
+			      &len);
+	if (!ret) {
+		*got = 0;
+		return 0;
+	}
+	*got = min(count, len);
+	if (len == *got)
+		return ret;
+
+	/* Keep the blocks past the request as the new window */
+	percpu_counter_add(&sbi->nr_free_blocks, len - *got);
+	spin_lock(&sbi->prealloc_lock);
+	spin_lock(&ci->prealloc_lock);
+	if (!ci->prealloc_len) {
+		ci->prealloc_start = ret + *got;
+		ci->prealloc_len = len - *got;
+		list_move(&ci->prealloc_list, &sbi->prealloc_inodes);
+		len = *got;
+	}
+	spin_unlock(&ci->prealloc_lock);
+	spin_unlock(&sbi->prealloc_lock);
+
+	/* Another window was installed meanwhile */
+	if (len != *got)
+		put_blocks(sbi, ret + *got, len - *got);
+
+	return ret;
+}
+
+/*
+ * Delayed allocation
+ *
+ * Data written through the page cache gets its blocks at writeback time only
+ * (see ouichefs_writepages()). Until then, the space is reserved in
+ * nr_dirty_blocks, so that writeback cannot run out of blocks. A reservation
+ * is released when its block is allocated or when its page is dropped.
+ */
+
+/*
+ * Return the number of free blocks that are not reserved. The approximate
+ * per-CPU values are used unless they are too close to call.
+ */
+uint32_t ouichefs_avail_blocks(struct ouichefs_sb_info *sbi)
+{
+	s64 free, dirty;
+
+	free = percpu_counter_read_positive(&sbi->nr_free_blocks);
+	dirty = percpu_counter_read_positive(&sbi->nr_dirty_blocks);
+	if (free - dirty < 2 * num_online_cpus() * OUICHEFS_BATCH_SIZE) {
+		free = percpu_counter_sum_positive(&sbi->nr_free_blocks);
+		dirty = percpu_counter_sum_positive(&sbi->nr_dirty_blocks);
+	}
+
+	return free > dirty ? free - dirty : 0;
+}
+
+/*
+ * Reserve count blocks for delayed allocation.
+ * Return 0 on success, -ENOSPC if there are not enough free blocks.
+ */
+int ouichefs_reserve_blocks(struct ouichefs_sb_info *sbi, uint32_t count)
+{
+	if (ouichefs_avail_blocks(sbi) < count)
+		return -ENOSPC;
+	percpu_counter_add(&sbi->nr_dirty_blocks, count);
+
+	return 0;
+}
+
+void ouichefs_release_blocks(struct ouichefs_sb_info *sbi, uint32_t count)
+{
+	percpu_counter_sub(&sbi->nr_dirty_blocks, count);
+}
+
+/*
+ * Build the summary of freemap, a free bitmap of size bits.
+ * Return 0 on success, -ENOMEM if the summary could not be allocated.
+ */
+int ouichefs_bitmap_sum_init(struct ouichefs_bitmap_sum *sum,
+			     unsigned long *freemap, unsigned long size)
+{
+	unsigned long nr_words = BITS_TO_LONGS(size);
+	unsigned long nr_l1 = BITS_TO_LONGS(nr_words);
+	unsigned long w, word;
+
+	sum->l1 = kcalloc(nr_l1, sizeof(unsigned long), GFP_KERNEL);
+	if (!sum->l1)
+		return -ENOMEM;
+	sum->l2 = kcalloc(BITS_TO_LONGS(nr_l1), sizeof(unsigned long),
+			  GFP_KERNEL);
+	if (!sum->l2) {
+		kfree(sum->l1);
+		sum->l1 = NULL;
+		return -ENOMEM;
+	}
+
+	for (w = 0; w < nr_words; w++) {
+		word = freemap[w];
+		/* Ignore the bits past the end of the bitmap */
+		if (w == nr_words - 1)
+			word &= BITMAP_LAST_WORD_MASK(size);
+		if (!word)
+			continue;
+		__set_bit(w, sum->l1);
+		__set_bit(BIT_WORD(w), sum->l2);
+	}
+	sum->cursor = 0;
+
+	return 0;
+}
+
+void ouichefs_bitmap_sum_destroy(struct ouichefs_bitmap_sum *sum)
+{
+	kfree(sum->l1);
+	kfree(sum->l2);
+	sum->l1 = NULL;
+	sum->l2 = NULL;
+}
+
+/*
+ * Free extent tree
+ *
+ * The free extent tree of a group mirrors its bfree_bitmap with one node per
+ * run of free blocks, identified by their (global) block numbers. Each node is
+ * linked in two rbtrees: one sorted by start block, used to find the free
+ * extent closest to a goal and to merge neighbours when blocks are freed, and
+ * one sorted by length, used to find an extent large enough for a request.
+ * Both lookups are O(log n) in the number of extents.
+ *
+ * If a node cannot be allocated, the tree is dropped and the allocator falls
+ * back to scanning the bitmap of the group until the next mount. Apart from
+ * the initial build, the tree is only modified with grp->balloc_lock held, so
+ * nodes are allocated with GFP_ATOMIC.
+ */
+
+static inline struct ouichefs_fext *fext_of_start(struct rb_node *node)
+{
+	return rb_entry(node, struct ouichefs_fext, by_start);
+}
+
+static inline struct ouichefs_fext *fext_of_len(struct rb_node *node)
+{
+	return rb_entry(node, struct ouichefs_fext, by_len);
+}
+
+static inline bool fext_start_less(struct rb_node *a, const struct rb_node *b)
+{
+	return fext_of_start(a)->start <
+	       rb_entry(b, struct ouichefs_fext, by_start)->start;
+}
+
+static inline bool fext_len_less(struct rb_node *a, const struct rb_node *b)
+{
+	struct ouichefs_fext *fa = fext_of_len(a);
+	const struct ouichefs_fext *fb =
+		rb_entry(b, struct ouichefs_fext, by_len);
+
+	if (fa->len != fb->len)
+		return fa->len < fb->len;
+	return fa->start < fb->start;
+}
+
+static struct ouichefs_fext *fext_alloc(uint32_t start, uint32_t len,
+				       gfp_t gfp)
+{
+	struct ouichefs_fext *fe;
+
+	fe = kmalloc(sizeof(*fe), gfp);
+	if (!fe)
+		return NULL;
+	fe->start = start;
+	fe->len = len;
+
+	return fe;
+}
+
+static void fext_link(struct ouichefs_fext_tree *tree,
+		      struct ouichefs_fext *fe)
+{
+	rb_add(&fe->by_start, &tree->by_start, fext_start_less);
+	rb_add(&fe->by_len, &tree->by_len, fext_len_less);
+	tree->nr_extents++;
+}
+
+static void fext_unlink(struct ouichefs_fext_tree *tree,
+			struct ouichefs_fext *fe)
+{
+	rb_erase(&fe->by_start, &tree->by_start);
+	rb_erase(&fe->by_len, &tree->by_len);
+	tree->nr_extents--;
+}
+
+/*
+ * Change the boundaries of an extent. The new extent must not overlap its
+ * neighbours, so its position in the start tree does not change.
+ */
+static void fext_resize(struct ouichefs_fext_tree *tree,
+			struct ouichefs_fext *fe, uint32_t start, uint32_t len)
+{
+	rb_erase(&fe->by_len, &tree->by_len);
+	fe->start = start;
+	fe->len = len;
+	rb_add(&fe->by_len, &tree->by_len, fext_len_less);
+}
+
+/*
+ * Return the free extent with the largest start block lower than or equal to
+ * bno, or NULL if there is none.
+ */
+static struct ouichefs_fext *fext_lookup(struct ouichefs_fext_tree *tree,
+					 uint32_t bno)
+{
+	struct rb_node *node = tree->by_start.rb_node;
+	struct ouichefs_fext *fe, *prev = NULL;
+
+	while (node) {
+		fe = fext_of_start(node);
+		if (bno < fe->start) {
+			node = node->rb_left;
+		} else {
+			prev = fe;
+			node = node->rb_right;
+		}
+	}
+
+	return prev;
+}
+
+/*
+ * Return the smallest free extent at least count blocks long, or NULL if
+ * there is none.
+ */
+static struct ouichefs_fext *fext_best_fit(struct ouichefs_fext_tree *tree,
+					   uint32_t count)
+{
+	struct rb_node *node = tree->by_len.rb_node;
+	struct ouichefs_fext *fe, *best = NULL;
+
+	while (node) {
+		fe = fext_of_len(node);
+		if (fe->len >= count) {
+			best = fe;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Drop the tree after a failed node allocation.
+ */
+static void fext_invalidate(struct ouichefs_group *grp)
+{
+	pr_warn("out of memory, falling back to bitmap allocation\n");
+	ouichefs_fext_destroy(grp);
+}
+
+/*
+ * Remove [start, start + len[ from the free extent fe, which contains it.
+ * Return 0 on success, -ENOMEM if fe had to be split and the tree was dropped.
+ */
+static int fext_carve(struct ouichefs_group *grp, struct ouichefs_fext *fe,
+		      uint32_t start, uint32_t len)
+{
+	struct ouichefs_fext_tree *tree = &grp->fext;
+	uint32_t end = fe->start + fe->len;
+	struct ouichefs_fext *tail;
+
+	if (start == fe->start && len == fe->len) {
+		fext_unlink(tree, fe);
+		kfree(fe);
+	} else if (start == fe->start) {
+		fext_resize(tree, fe, start + len, fe->len - len);
+	} else if (start + len == end) {
+		fext_resize(tree, fe, fe->start, fe->len - len);
+	} else {
+		tail = fext_alloc(start + len, end - start - len, GFP_ATOMIC);
+		if (!tail) {
+			fext_invalidate(grp);
+			return -ENOMEM;
+		}
+		fext_resize(tree, fe, fe->start, start - fe->start);
+		fext_link(tree, tail);
+	}
+
+	return 0;
+}
+
+/*
+ * Find and remove up to count contiguous blocks from the free extent tree.
+ * The free extent containing goal is used first, starting at goal. Otherwise,
+ * the next free extent is used if it is large enough, then the smallest free
+ * extent large enough, and finally the largest free extent.
+ * The number of blocks found is stored in got. Only the tree is updated, the
+ * caller is responsible for bfree_bitmap and the free blocks counter.
+ * Return the first block found, or 0 if the tree is empty or was dropped.
+ */
+uint32_t ouichefs_fext_alloc(struct ouichefs_group *grp, uint32_t goal,
+			     uint32_t count, uint32_t *got)
+{
+	struct ouichefs_fext_tree *tree = &grp->fext;
+	struct ouichefs_fext *fe, *next = NULL;
+	struct rb_node *node;
+	uint32_t start;
+
+	*got = 0;
+
+	fe = fext_lookup(tree, goal);
+	if (fe && goal < fe->start + fe->len) {
+		start = goal;
+		goto carve;
+	}
+
+	node = fe ? rb_next(&fe->by_start) : rb_first(&tree->by_start);
+	if (node)
+		next = fext_of_start(node);
+	if (next && next->len >= count) {
+		fe = next;
+		start = fe->start;
+		goto carve;
+	}
+
+	fe = fext_best_fit(tree, count);
+	if (!fe) {
+		node = rb_last(&tree->by_len);
+		if (!node)
+			return 0;
+		fe = fext_of_len(node);
+	}
+	start = fe->start;
+
+carve:
+	count = min(count, fe->start + fe->len - start);
+	if (fext_carve(grp, fe, start, count))
+		return 0;
+	*got = count;
+
+	return start;
+}
+
+/*
+ * Add [start, start + len[ to the free extent tree, merging it with the
+ * adjacent free extents.
+ */
+void ouichefs_fext_free(struct ouichefs_group *grp, uint32_t start,
+			uint32_t len)
+{
+	struct ouichefs_fext_tree *tree = &grp->fext;
+	struct ouichefs_fext *prev, *next = NULL, *fe;
+	struct rb_node *node;
+
+	prev = fext_lookup(tree, start);
+	node = prev ? rb_next(&prev->by_start) : rb_first(&tree->by_start);
+	if (node)
+		next = fext_of_start(node);
+
+	if (prev && prev->start + prev->len == start) {
+		if (next && start + len == next->start) {
+			len += next->len;
+			fext_unlink(tree, next);
+			kfree(next);
+		}
+		fext_resize(tree, prev, prev->start, prev->len + len);
+		return;
+	}
+
+	if (next && start + len == next->start) {
+		fext_resize(tree, next, start, next->len + len);
+		return;
+	}
+
+	fe = fext_alloc(start, len, GFP_ATOMIC);
+	if (!fe) {
+		fext_invalidate(grp);
+		return;
+	}
+	fext_link(tree, fe);
+}
+
+/*
+ * Return the length of the largest free extent.
+ */
+uint32_t ouichefs_fext_largest(struct ouichefs_group *grp)
+{
+	struct rb_node *node = rb_last(&grp->fext.by_len);
+
+	if (!node)
+		return 0;
+	return fext_of_len(node)->len;
+}
+
+/*
+ * Build the free extent tree of a group from its bfree_bitmap.
+ * Return 0 on success, -ENOMEM if the tree could not be built.
+ */
+int ouichefs_fext_build(struct ouichefs_group *grp)
+{
+	struct ouichefs_fext_tree *tree = &grp->fext;
+	struct ouichefs_fext *fe;
+	unsigned long start = 0, end;
+
+	tree->by_start = RB_ROOT;
+	tree->by_len = RB_ROOT;
+	tree->nr_extents = 0;
+
+	for (;;) {
+		start = find_next_bit(grp->bfree_bitmap, grp->nr_blocks, start);
+		if (start >= grp->nr_blocks)
+			break;
+		end = find_next_zero_bit(grp->bfree_bitmap, grp->nr_blocks,
+					 start);
+
+		fe = fext_alloc(grp->first_block + start, end - start,
+				GFP_KERNEL);
+		if (!fe) {
+			ouichefs_fext_destroy(grp);
+			return -ENOMEM;
+		}
+		fext_link(tree, fe);
+
+		start = end;
+	}
+	tree->valid = true;
+
+	return 0;
+}
+
+/*
+ * Free all the nodes of the free extent tree.
+ */
+void ouichefs_fext_destroy(struct ouichefs_group *grp)
+{
+	struct ouichefs_fext_tree *tree = &grp->fext;
+	struct ouichefs_fext *fe, *tmp;
+
+	rbtree_postorder_for_each_entry_safe(fe, tmp, &tree->by_start,
+					     by_start)
+		kfree(fe);
+
+	tree->by_start = RB_ROOT;
+	tree->by_len = RB_ROOT;
+	tree->nr_extents = 0;
+	tree->valid = false;
+}
@@ -11,97 +11,267 @@
 #include "ouichefs.h"
 
 /*
- * Return the first free bit (set to 1) in a given in-memory bitmap spanning
- * over multiple blocks and clear it.
- * Return 0 if no free bit found (we assume that the first bit is never free
- * because of the superblock and the root inode, thus allowing us to use 0 as an
- * error value).
+ * Summary bitmaps
+ *
+ * Each in-memory free bitmap comes with a two-level summary (see struct
+ * ouichefs_bitmap_sum): bit w of l1 is set if word w of the bitmap may contain
+ * a free bit, and bit i of l2 is set if word i of l1 is not zero. Looking for
+ * a free bit therefore reads at most one word of l2's size per level instead
+ * of the whole bitmap. Summaries are updated by the helpers below every time
+ * bits are cleared or set.
  */
-static inline uint32_t get_first_free_bit(unsigned long *freemap,
-					  unsigned long size)
+
+/*
+ * Return the first word of a bitmap at or after w that may contain a free bit
+ * according to its summary, or nr_words if there is none.
+ */
+static inline unsigned long sum_find_next_word(struct ouichefs_bitmap_sum *sum,
+					       unsigned long nr_words,
+					       unsigned long w)
 {
-	uint32_t ino;
+	unsigned long nr_l1 = BITS_TO_LONGS(nr_words);
+	unsigned long end, ret;
+
+	if (w >= nr_words)
+		return nr_words;
 
-	ino = find_first_bit(freemap, size);
-	if (ino == size)
-		return 0;
+	/* Remainder of the l1 word containing w */
+	end = min(nr_words, round_up(w + 1, BITS_PER_LONG));
+	ret = find_next_bit(sum->l1, end, w);
+	if (ret < end)
+		return ret;
 
-	bitmap_clear(freemap, ino, 1);
+	/* Next non-empty l1 word according to l2 */
+	ret = find_next_bit(sum->l2, nr_l1, BIT_WORD(w) + 1);
+	if (ret >= nr_l1)
+		return nr_words;
 
-	return ino;
+	return find_next_bit(sum->l1, nr_words, ret * BITS_PER_LONG);
 }
 
 /*
- * Return an unused inode number and mark it used.
- * Return 0 if no free inode was found.
+ * Return the first free bit (set to 1) at or after start in a given in-memory
+ * bitmap of size bits, using its summary, or size if there is none.
  */
-static inline uint32_t get_free_inode(struct ouichefs_sb_info *sbi)
+static inline unsigned long sum_find_next_bit(unsigned long *freemap,
+					      struct ouichefs_bitmap_sum *sum,
+					      unsigned long size,
+					      unsigned long start)
 {
-	uint32_t ret;
+	unsigned long end, ret;
 
-	ret = get_first_free_bit(sbi->ifree_bitmap, sbi->nr_inodes);
-	if (ret) {
-		sbi->nr_free_inodes--;
-		pr_debug("%s:%d: allocated inode %u\n", __func__, __LINE__,
-			 ret);
+	if (start >= size)
+		return size;
+
+	/* Remainder of the word containing start */
+	end = min(size, round_up(start + 1, BITS_PER_LONG));
+	ret = find_next_bit(freemap, end, start);
+	if (ret < end)
+		return ret;
+
+	/* Next non-empty word according to the summary */
+	ret = sum_find_next_word(sum, BITS_TO_LONGS(size), BIT_WORD(start) + 1);
+	if (ret >= BITS_TO_LONGS(size))
+		return size;
+
+	return find_next_bit(freemap, size, ret * BITS_PER_LONG);
+}
+
+/*
+ * Mark bits [start, start + len[ of freemap as used (i.e. 0) and update its
+ * summary.
+ */
+static inline void clear_free_bits(unsigned long *freemap,
+				   struct ouichefs_bitmap_sum *sum,
+				   unsigned long start, unsigned long len)
+{
+	unsigned long w;
+
+	bitmap_clear(freemap, start, len);
+
+	for (w = BIT_WORD(start); w <= BIT_WORD(start + len - 1); w++) {
+		if (freemap[w])
+			continue;
+		__clear_bit(w, sum->l1);
+		if (!sum->l1[BIT_WORD(w)])
+			__clear_bit(BIT_WORD(w), sum->l2);
 	}
-	return ret;
 }
 
 /*
- * Return an unused block number and mark it used.
- * Return 0 if no free block was found.
+ * Mark bits [start, start + len[ of freemap as free (i.e. 1) and update its
+ * summary.
  */
-static inline uint32_t get_free_block(struct ouichefs_sb_info *sbi)
+static inline void set_free_bits(unsigned long *freemap,
+				 struct ouichefs_bitmap_sum *sum,
+				 unsigned long start, unsigned long len)
 {
-	uint32_t ret;
+	unsigned long w;
 
-	ret = get_first_free_bit(sbi->bfree_bitmap, sbi->nr_blocks);
-	if (ret) {
-		sbi->nr_free_blocks--;
-		pr_debug("%s:%d: allocated block %u\n", __func__, __LINE__,
-			 ret);
+	bitmap_set(freemap, start, len);
+
+	for (w = BIT_WORD(start); w <= BIT_WORD(start + len - 1); w++) {
+		__set_bit(w, sum->l1);
+		__set_bit(BIT_WORD(w), sum->l2);
 	}
-	return ret;
+}
+
+/*
+ * Find a run of up to count free bits (set to 1) in a given in-memory bitmap
+ * spanning over multiple blocks and clear them. The run starting at goal is
+ * used if goal is free, otherwise the first run of count free bits after goal.
+ * If there is no such run, the first free bits found after goal are used, the
+ * search wrapping around to the beginning of the bitmap.
+ * The length of the run is stored in len, and the roving cursor of the bitmap
+ * is moved right after the run.
+ * Return the first bit of the run, or 0 if no free bit found (we assume that
+ * the first bit is never free because of the superblock and the root inode,
+ * or the backup superblock and the reserved first inode of allocation groups,
+ * thus allowing us to use 0 as an error value).
+ */
+static inline uint32_t get_free_bits(unsigned long *freemap,
+				     struct ouichefs_bitmap_sum *sum,
+				     unsigned long size, unsigned long goal,
+				     uint32_t count, uint32_t *len)
+{
+	unsigned long start, end;
+
+	*len = 0;
+	if (goal >= size)
+		goal = 0;
+
+	/* Look for a run of count free bits after goal */
+	start = goal;
+	while (start < size) {
+		start = sum_find_next_bit(freemap, sum, size, start);
+		if (start == size)
+			break;
+		end = find_next_zero_bit(
+			freemap, min_t(unsigned long, size, start + count),
+			start);
+		if (start == goal || end - start == count)
+			goto found;
+		start = end;
+	}
+
+	/* No such run, use the first free bits found */
+	start = sum_find_next_bit(freemap, sum, size, goal);
+	if (start == size) {
+		start = sum_find_next_bit(freemap, sum, goal, 0);
+		if (start == goal)
+			return 0;
+	}
+	end = find_next_zero_bit(freemap,
+				 min_t(unsigned long, size, start + count),
+				 start);
+
+found:
+	clear_free_bits(freemap, sum, start, end - start);
+	*len = end - start;
+	sum->cursor = end;
+
+	return start;
+}
+
+/*
+ * Return the first free bit (set to 1) at or after goal in a given in-memory
+ * bitmap spanning over multiple blocks and clear it.
+ * Return 0 if no free bit found.
+ */
+static inline uint32_t get_first_free_bit(unsigned long *freemap,
+					  struct ouichefs_bitmap_sum *sum,
+					  unsigned long size, unsigned long goal)
+{
+	uint32_t len;
+
+	return get_free_bits(freemap, sum, size, goal, 1, &len);
 }
 
 /*
  * Mark the i-th bit in freemap as free (i.e. 1)
  */
-static inline int put_free_bit(unsigned long *freemap, unsigned long size,
-			       uint32_t i)
+static inline int put_free_bit(unsigned long *freemap,
+			       struct ouichefs_bitmap_sum *sum,
+			       unsigned long size, uint32_t i)
 {
-	/* i is greater than freemap size */
-	if (i > size)
+	/* i is out of freemap */
+	if (i >= size)
 		return -1;
 
-	bitmap_set(freemap, i, 1);
+	set_free_bits(freemap, sum, i, 1);
 
 	return 0;
 }
 
 /*
- * Mark an inode as unused.
+ * The helpers prefixed with __ below must be called with grp->balloc_lock
+ * held. They update the free blocks counter of the group, but not the global
+ * one, this is left to their callers (see balloc.c).
  */
-static inline void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino)
+
+/*
+ * Find up to count contiguous unused blocks in a group and mark them used.
+ * Blocks are chosen as close as possible to goal, so that passing the block
+ * following the previous block of a file keeps sequentially written files
+ * contiguous on disk. The free extent tree is used if it is available (see
+ * ouichefs_fext_alloc()), otherwise the bitmap is searched (see
+ * get_free_bits()). Without a goal in the group, the search starts at the
+ * roving cursor of the block bitmap of the group.
+ * The number of blocks found is stored in got.
+ * Return the first block number found, or 0 if no free block was found.
+ */
+static inline uint32_t __get_free_blocks(struct ouichefs_group *grp,
+					 uint32_t goal, uint32_t count,
+					 uint32_t *got)
 {
-	if (put_free_bit(sbi->ifree_bitmap, sbi->nr_inodes, ino))
-		return;
+	uint32_t ret = 0;
 
-	sbi->nr_free_inodes++;
-	pr_debug("%s:%d: freed inode %u\n", __func__, __LINE__, ino);
+	*got = 0;
+	if (goal <= grp->first_block ||
+	    goal >= grp->first_block + grp->nr_blocks)
+		goal = grp->first_block + grp->bfree_sum.cursor;
+	if (grp->fext.valid)
+		ret = ouichefs_fext_alloc(grp, goal, count, got);
+	if (ret) {
+		clear_free_bits(grp->bfree_bitmap, &grp->bfree_sum,
+				ret - grp->first_block, *got);
+		grp->bfree_sum.cursor = ret - grp->first_block + *got;
+	} else if (!grp->fext.valid) {
+		ret = get_free_bits(grp->bfree_bitmap, &grp->bfree_sum,
+				    grp->nr_blocks, goal - grp->first_block,
+				    count, got);
+		if (ret)
+			ret += grp->first_block;
+	}
+	grp->nr_free_blocks -= *got;
+
+	return ret;
 }
 
 /*
- * Mark a block as unused.
+ * Mark blocks [start, start + len[ of a group as unused.
+ */
+static inline void __put_blocks(struct ouichefs_group *grp, uint32_t start,
+				uint32_t len)
+{
+	set_free_bits(grp->bfree_bitmap, &grp->bfree_sum,
+		      start - grp->first_block, len);
+	if (grp->fext.valid)
+		ouichefs_fext_free(grp, start, len);
+	grp->nr_free_blocks += len;
+}
+
+/*
+ * Return an unused block number, as close as possible to goal, and mark it
+ * used.
+ * Return 0 if no free block was found.
  */
-static inline void put_block(struct ouichefs_sb_info *sbi, uint32_t bno)
+static inline uint32_t get_free_block(struct ouichefs_sb_info *sbi,
+				      uint32_t goal)
 {
-	if (put_free_bit(sbi->bfree_bitmap, sbi->nr_blocks, bno))
-		return;
+	uint32_t got;
 
-	sbi->nr_free_blocks++;
-	pr_debug("%s:%d: freed block %u\n", __func__, __LINE__, bno);
+	return get_free_blocks(sbi, goal, 1, &got);
 }
 
 #endif /* _OUICHEFS_BITMAP_H */
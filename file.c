@@ -10,215 +10,108 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/fs.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
-#include <linux/mpage.h>
+#include <linux/falloc.h>
+#include <linux/iomap.h>
+#include <linux/slab.h>
+#include <linux/writeback.h>
 
 #include "ouichefs.h"
 #include "bitmap.h"
 #include "ouicheioctl.h"
 
 /*
- * Map the buffer_head passed in argument with the iblock-th block of the file
- * represented by inode. If the requested block is not allocated and create is
- * true, allocate a new block on disk and map it.
+ * Insert mode index entry of a hole: a full block (4095 bytes) of zeroes with
+ * no block allocated (block number 0). In insert mode, i_blocks counts the
+ * entries of the index (holes included) plus the index block, not the blocks
+ * allocated: the insert functions use it as the number of entries.
  */
-static int ouichefs_file_get_block(struct inode *inode, sector_t iblock,
-				   struct buffer_head *bh_result, int create)
-{
-	struct super_block *sb = inode->i_sb;
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-	struct ouichefs_file_index_block *index;
-	struct buffer_head *bh_index;
-	int ret = 0, bno;
-
-	/* If block number exceeds filesize, fail */
-	if (iblock >= OUICHEFS_BLOCK_SIZE >> 2)
-		return -EFBIG;
-
-	/* Read index block from disk */
-	bh_index = sb_bread(sb, ci->index_block);
-	if (!bh_index)
-		return -EIO;
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
-
-	/*
-	 * Check if iblock is already allocated. If not and create is true,
-	 * allocate it. Else, get the physical block number.
-	 */
-	if (index->blocks[iblock] == 0) {
-		if (!create) {
-			ret = 0;
-			goto brelse_index;
-		}
-		bno = get_free_block(sbi);
-		if (!bno) {
-			ret = -ENOSPC;
-			goto brelse_index;
-		}
-		index->blocks[iblock] = bno;
-	} else {
-		bno = index->blocks[iblock];
-	}
-
-	/* Map the physical block to the given buffer_head */
-	map_bh(bh_result, sb, bno);
-
-brelse_index:
-	brelse(bh_index);
-
-	return ret;
-}
+#define OUICHEFS_INSERT_HOLE ((uint32_t)(OUICHEFS_BLOCK_SIZE - 1) << 20)
 
 /*
- * Called by the page cache to read a page from the physical disk and map it in
- * memory.
+ * Readahead state of an open file (file->private_data), for the reads that do
+ * not go through the page cache: ouichefs_read() and ouichefs_read_insert().
+ * A read starting where the previous one ended is sequential and doubles the
+ * window, up to OUICHEFS_RA_MAX blocks, any other read closes it. Readers
+ * sharing the open file update it concurrently, under its lock.
  */
-static void ouichefs_readahead(struct readahead_control *rac)
-{
-	mpage_readahead(rac, ouichefs_file_get_block);
-}
+struct ouichefs_ra_state {
+	spinlock_t lock; /* Protects the fields below */
+	loff_t next; /* End of the previous read */
+	loff_t ahead; /* End of the data read ahead */
+	uint32_t window; /* Blocks to read ahead, 0 for random access */
+};
 
-/*
- * Called by the page cache to write a dirty page to the physical disk (when
- * sync is called or when memory is needed).
- */
-static int ouichefs_writepage(struct page *page, struct writeback_control *wbc)
-{
-	return block_write_full_page(page, ouichefs_file_get_block, wbc);
-}
+#define OUICHEFS_RA_MIN 4
+#define OUICHEFS_RA_MAX 256
 
 /*
- * Called by the VFS when a write() syscall occurs on file before writing the
- * data in the page cache. This functions checks if the write will be able to
- * complete and allocates the necessary blocks through block_write_begin().
+ * Return the preferred physical block for the iblock-th block of an insert mode
+ * file: the block right after the closest allocated block preceding iblock in
+ * the index, or right after the index block for the first block of the file.
+ * Only the 20 least significant bits of an insert mode entry hold the block
+ * number (see ouichefs_map_goal() for normal mode).
  */
-static int ouichefs_write_begin(struct file *file,
-				struct address_space *mapping, loff_t pos,
-				unsigned int len, struct page **pagep,
-				void **fsdata)
+static uint32_t ouichefs_block_goal(struct ouichefs_inode_info *ci,
+				    struct ouichefs_file_index_block *index,
+				    sector_t iblock)
 {
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(file->f_inode->i_sb);
-	int err;
-	uint32_t nr_allocs = 0;
-
-	/* Check if the write can be completed (enough space?) */
-	if (pos + len > OUICHEFS_MAX_FILESIZE)
-		return -ENOSPC;
-	nr_allocs = max(pos + len, file->f_inode->i_size) / OUICHEFS_BLOCK_SIZE;
-	if (nr_allocs > file->f_inode->i_blocks - 1)
-		nr_allocs -= file->f_inode->i_blocks - 1;
-	else
-		nr_allocs = 0;
-	if (nr_allocs > sbi->nr_free_blocks)
-		return -ENOSPC;
+	uint32_t bno;
 
-	/* prepare the write */
-	err = block_write_begin(mapping, pos, len, pagep,
-				ouichefs_file_get_block);
-	/* if this failed, reclaim newly allocated blocks */
-	if (err < 0) {
-		pr_err("%s:%d: newly allocated blocks reclaim not implemented yet\n",
-		       __func__, __LINE__);
+	while (iblock-- > 0) {
+		bno = index->blocks[iblock] & 0x000FFFFF;
+		if (bno)
+			return bno + 1;
 	}
-	return err;
+
+	return ci->index_block + 1;
 }
 
 /*
- * Called by the VFS after writing data from a write() syscall to the page
- * cache. This functions updates inode metadata and truncates the file if
- * necessary.
+ * ouichefs_alloc_index_range() - allocate the missing blocks of a file
+ * @inode:	the inode of the file
+ * @index:	the insert mode index block of the file
+ * @first:	the first index entry to fill
+ * @last:	the last index entry to fill
+ *
+ * Fill the empty entries of the index between first and last (included) with
+ * newly allocated blocks of size 0, with one allocator call per contiguous
+ * extent. The caller is responsible for marking the index block dirty.
+ *
+ * Return: 0 on success, -ENOSPC if the disk is full. In the latter case, the
+ * entries filled so far are kept.
  */
-static int ouichefs_write_end(struct file *file, struct address_space *mapping,
-			      loff_t pos, unsigned int len, unsigned int copied,
-			      struct page *page, void *fsdata)
+static int ouichefs_alloc_index_range(struct inode *inode,
+				      struct ouichefs_file_index_block *index,
+				      sector_t first, sector_t last)
 {
-	int ret;
-	struct inode *inode = file->f_inode;
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-	struct super_block *sb = inode->i_sb;
-
-	/* Complete the write() */
-	ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
-	if (ret < len) {
-		pr_err("%s:%d: wrote less than asked... what do I do? nothing for now...\n",
-		       __func__, __LINE__);
-	} else {
-		uint32_t nr_blocks_old = inode->i_blocks;
-
-		/* Update inode metadata */
-		inode->i_blocks = inode->i_size / OUICHEFS_BLOCK_SIZE + 2;
-		inode->i_mtime = inode->i_ctime = current_time(inode);
-		mark_inode_dirty(inode);
-
-		/* If file is smaller than before, free unused blocks */
-		if (nr_blocks_old > inode->i_blocks) {
-			int i;
-			struct buffer_head *bh_index;
-			struct ouichefs_file_index_block *index;
-
-			/* Free unused blocks from page cache */
-			truncate_pagecache(inode, inode->i_size);
-
-			/* Read index block to remove unused blocks */
-			bh_index = sb_bread(sb, ci->index_block);
-			if (!bh_index) {
-				pr_err("failed truncating '%s'. we just lost %llu blocks\n",
-				       file->f_path.dentry->d_name.name,
-				       nr_blocks_old - inode->i_blocks);
-				goto end;
-			}
-			index = (struct ouichefs_file_index_block *)
-					bh_index->b_data;
-
-			for (i = inode->i_blocks - 1; i < nr_blocks_old - 1;
-			     i++) {
-				put_block(OUICHEFS_SB(sb), index->blocks[i]);
-				index->blocks[i] = 0;
-			}
-			mark_buffer_dirty(bh_index);
-			brelse(bh_index);
-		}
-	}
-end:
-	return ret;
-}
-
-const struct address_space_operations ouichefs_aops = {
-	.readahead = ouichefs_readahead,
-	.writepage = ouichefs_writepage,
-	.write_begin = ouichefs_write_begin,
-	.write_end = ouichefs_write_end
-};
-
-static int ouichefs_open(struct inode *inode, struct file *file)
-{
-	bool wronly = (file->f_flags & O_WRONLY) != 0;
-	bool rdwr = (file->f_flags & O_RDWR) != 0;
-	bool trunc = (file->f_flags & O_TRUNC) != 0;
-
-	if ((wronly || rdwr) && trunc && (inode->i_size != 0)) {
-		struct super_block *sb = inode->i_sb;
-		struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-		struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-		struct ouichefs_file_index_block *index;
-		struct buffer_head *bh_index;
-		sector_t iblock;
-
-		/* Read index block from disk */
-		bh_index = sb_bread(sb, ci->index_block);
-		if (!bh_index)
-			return -EIO;
-		index = (struct ouichefs_file_index_block *)bh_index->b_data;
+	sector_t i = first;
+	uint32_t bno, got, count, j;
 
-		for (iblock = 0; index->blocks[iblock] != 0; iblock++) {
-			put_block(sbi, index->blocks[iblock]);
-			index->blocks[iblock] = 0;
+	while (i <= last) {
+		if (index->blocks[i]) {
+			i++;
+			continue;
 		}
-		inode->i_size = 0;
-		inode->i_blocks = 0;
 
-		brelse(bh_index);
+		/* Count the empty entries starting at i */
+		for (count = 1; i + count <= last && !index->blocks[i + count];
+		     count++)
+			;
+
+		bno = get_free_file_blocks(inode,
+				      ouichefs_block_goal(ci, index, i),
+				      count, &got);
+		if (!bno)
+			return -ENOSPC;
+
+		for (j = 0; j < got; j++)
+			index->blocks[i + j] = bno + j;
+		inode->i_blocks += got;
+		i += got;
 	}
 
 	return 0;
@@ -250,15 +143,43 @@ static inline size_t ouichefs_file_size(struct inode *inode,
  * @index:	the index block of the file
  * @write_mode:	1 if we are writing, 0 if we are reading
  *
+ * The block is found in O(log n) with the Fenwick tree of the sizes of the
+ * blocks (see ouichefs_insert_sums_get()), or by adding up the sizes of the
+ * index if it is not available. Called with ci->map_sem held.
+ *
  * Return: The position in the block
  */
 static inline loff_t
 ouichefs_find_block(struct inode *inode, loff_t *pos, sector_t *iblock,
 		    struct ouichefs_file_index_block *index, int write_mode)
 {
+	const uint32_t *sums = ouichefs_insert_sums_get(inode);
+	uint32_t nr = min_t(blkcnt_t, inode->i_blocks - 1, OUICHEFS_PTRS);
 	uint32_t total = 0;
 	uint32_t i = 0;
 
+	/*
+	 * Premier bloc dont la fin dépasse pos (en lecture) ou l'atteint (en
+	 * écriture) : les i premiers blocs finissent avant.
+	 */
+	if (sums) {
+		if (!write_mode)
+			i = ouichefs_insert_sums_find(sums, *pos, &total);
+		else if (*pos)
+			i = ouichefs_insert_sums_find(sums, *pos - 1, &total);
+		if (i < nr) {
+			*iblock = i;
+			if ((*pos - total) >= (OUICHEFS_BLOCK_SIZE - 1)) {
+				*iblock = i + 1;
+				return 0;
+			}
+			return *pos - total;
+		}
+		i = nr;
+		total = ouichefs_insert_sums_prefix(sums, nr);
+		goto new_block;
+	}
+
 	for (i = 0; i < inode->i_blocks - 1; i++) {
 		uint32_t tmp = total;
 		uint32_t block_size = (index->blocks[i] >> 20);
@@ -275,6 +196,7 @@ ouichefs_find_block(struct inode *inode, loff_t *pos, sector_t *iblock,
 		}
 	}
 	/* ecriture dans un nouveau bloc : ibloc = 0 et la position dns le bloc = 0 */
+new_block:;
 	uint32_t pos_in_bloc = (*pos - total) % (OUICHEFS_BLOCK_SIZE - 1);
 	uint32_t div = (*pos - total) / (OUICHEFS_BLOCK_SIZE - 1);
 
@@ -283,482 +205,1965 @@ ouichefs_find_block(struct inode *inode, loff_t *pos, sector_t *iblock,
 }
 
 /*
- * Read function for the ouichefs filesystem. This function allows to read data without
- * the use of page cache.
+ * Fill iomap with the mapping of the file blocks of inode starting at iblock,
+ * as returned by ouichefs_map_lookup(): len blocks from entry.
  */
-static ssize_t ouichefs_read(struct file *file, char __user *data, size_t len,
-			     loff_t *pos)
+static void ouichefs_set_iomap(struct inode *inode, struct iomap *iomap,
+			       sector_t iblock, uint32_t entry, uint32_t len)
 {
-	if (file->f_flags & O_WRONLY)
-		return -EBADF;
+	iomap->bdev = inode->i_sb->s_bdev;
+	iomap->offset = (loff_t)iblock << inode->i_blkbits;
+	iomap->length = (u64)len << inode->i_blkbits;
+	iomap->flags = 0;
+	if (!entry) {
+		iomap->type = IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
+		return;
+	}
+	/* Unwritten blocks read as zeroes, their content on disk is stale */
+	iomap->type = (entry & OUICHEFS_UNWRITTEN) ? IOMAP_UNWRITTEN :
+						     IOMAP_MAPPED;
+	iomap->addr = (u64)ouichefs_index_bno(entry) << inode->i_blkbits;
+}
 
-	if (*pos >= file->f_inode->i_size)
+/*
+ * Allocate up to *len blocks for the hole of inode at iblock, with ci->map_sem
+ * held for writing. On success, *entry and *len are set to the blocks
+ * allocated, which are already mapped with flags (OUICHEFS_UNWRITTEN or 0).
+ */
+static int ouichefs_alloc_hole(struct inode *inode, sector_t iblock,
+			       uint32_t *entry, uint32_t *len, uint32_t flags)
+{
+	struct super_block *sb = inode->i_sb;
+	uint32_t bno, got, i;
+	int ret;
+
+	bno = get_free_file_blocks(inode, ouichefs_map_goal(inode, iblock),
+				   *len, &got);
+	if (!bno)
+		return -ENOSPC;
+	ret = ouichefs_map_set(inode, iblock, bno | flags, got);
+	if (ret) {
+		for (i = 0; i < got; i++)
+			put_block(OUICHEFS_SB(sb), bno + i);
+		return ret;
+	}
+	/* Forget stale buffers of these blocks on the device */
+	clean_bdev_aliases(sb->s_bdev, bno, got);
+	inode->i_blocks += got;
+	mark_inode_dirty(inode);
+	*entry = bno | flags;
+	*len = got;
+
+	return 0;
+}
+
+/*
+ * Map the blocks of a direct write at iblock, with ci->map_sem held for
+ * writing. Holes are allocated as unwritten blocks: like the unwritten blocks
+ * of the file, they are marked as written once the data is on the disk (see
+ * ouichefs_dio_write_end_io()), so that a failed write never exposes their
+ * stale content.
+ */
+static int ouichefs_dio_map(struct inode *inode, sector_t iblock,
+			    uint32_t *entry, uint32_t *len)
+{
+	int ret;
+
+	if (*entry)
 		return 0;
+	ret = ouichefs_alloc_hole(inode, iblock, entry, len,
+				  OUICHEFS_UNWRITTEN);
+	if (ret)
+		return ret;
+	/* Blocks reserved by a racing buffered write, if any */
+	ouichefs_delayed_release(inode, iblock, iblock + *len - 1);
 
-	unsigned long to_be_copied = 0;
-	unsigned long copied_to_user = 0;
+	return 0;
+}
 
-	struct super_block *sb = file->f_inode->i_sb;
-	sector_t iblock = *pos / OUICHEFS_BLOCK_SIZE;
-	struct ouichefs_file_index_block *index;
-	struct buffer_head *bh_index;
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(file->f_inode);
+/*
+ * Called by iomap before reading or writing a file from pos, through the page
+ * cache or directly: map the blocks of the file from pos, as a single run of
+ * blocks in the same state and physically contiguous. Buffered writes to holes
+ * only reserve the blocks and report them as delayed (IOMAP_DELALLOC), with
+ * IOMAP_F_NEW if they were reserved by this call. Direct writes get their
+ * blocks allocated right away (see ouichefs_dio_map()). The data of an inline
+ * file is moved to a block before it is written.
+ */
+static int ouichefs_iomap_begin(struct inode *inode, loff_t pos, loff_t length,
+				unsigned int flags, struct iomap *iomap,
+				struct iomap *srcmap)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	sector_t iblock = pos >> inode->i_blkbits;
+	sector_t last = (pos + length - 1) >> inode->i_blkbits;
+	uint32_t max, entry, len, nr;
+	int ret;
 
-	/* If block number exceeds filesize, fail */
-	if (iblock >= OUICHEFS_BLOCK_SIZE >> 2)
+	if (pos >= inode->i_sb->s_maxbytes)
 		return -EFBIG;
+	max = min_t(sector_t, last - iblock + 1, U32_MAX);
+
+	if (!(flags & IOMAP_WRITE)) {
+		down_read(&ci->map_sem);
+		ret = ouichefs_map_lookup(inode, iblock, max, &entry, &len);
+		up_read(&ci->map_sem);
+		if (!ret)
+			ouichefs_set_iomap(inode, iomap, iblock, entry, len);
+		return ret;
+	}
 
-	/* Read index block from disk */
-	bh_index = sb_bread(sb, ci->index_block);
-	if (!bh_index)
-		return -EIO;
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+	down_write(&ci->map_sem);
+	ret = ouichefs_map_uninline(inode);
+	if (ret)
+		goto unlock;
+	ret = ouichefs_map_lookup(inode, iblock, max, &entry, &len);
+	if (ret)
+		goto unlock;
+	/*
+	 * Unwritten blocks are marked as written after their data is written,
+	 * which may split their extent: fail now rather than at that point.
+	 */
+	if ((entry & OUICHEFS_UNWRITTEN) && ouichefs_has_extents(inode)) {
+		ret = ouichefs_ext_room(inode);
+		if (ret < 0)
+			goto unlock;
+		ret = ret < 2 ? -ENOSPC : 0;
+		if (ret)
+			goto unlock;
+	}
+	if (flags & IOMAP_DIRECT) {
+		ret = ouichefs_dio_map(inode, iblock, &entry, &len);
+		if (ret)
+			goto unlock;
+	}
+	ouichefs_set_iomap(inode, iomap, iblock, entry, len);
+	if (entry)
+		goto unlock;
+
+	/* A hole: delayed blocks, reserved by a previous write or now */
+	nr = ouichefs_delayed_run(inode, iblock, len);
+	if (!nr) {
+		ret = ouichefs_delayed_reserve(inode, iblock, len);
+		if (ret < 0)
+			goto unlock;
+		nr = ret;
+		ret = 0;
+		iomap->flags |= IOMAP_F_NEW;
+	}
+	iomap->type = IOMAP_DELALLOC;
+	iomap->length = (u64)nr << inode->i_blkbits;
 
-	/* Get the block number for the current iblock */
-	uint32_t bno = index->blocks[iblock];
+unlock:
+	up_write(&ci->map_sem);
 
-	if (bno == 0) {
-		brelse(bh_index);
-		return -EIO;
-	}
+	return ret;
+}
+
+/*
+ * Called by iomap after reading or writing the page cache of a file with the
+ * mapping of ouichefs_iomap_begin(). After a short write, the blocks reserved
+ * by ouichefs_iomap_begin() that did not get any data are released.
+ */
+static int ouichefs_iomap_end(struct inode *inode, loff_t pos, loff_t length,
+			      ssize_t written, unsigned int flags,
+			      struct iomap *iomap)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	sector_t first, last;
 
-	struct buffer_head *bh = sb_bread(sb, bno);
+	/* i_size was updated by iomap */
+	if (iomap->flags & IOMAP_F_SIZE_CHANGED)
+		mark_inode_dirty(inode);
 
-	if (!bh) {
-		brelse(bh_index);
-		return -EIO;
+	if (iomap->type != IOMAP_DELALLOC || !(iomap->flags & IOMAP_F_NEW))
+		return 0;
+
+	/* The block of the last byte written, if any, has data */
+	if (written)
+		first = ((pos + written - 1) >> inode->i_blkbits) + 1;
+	else
+		first = pos >> inode->i_blkbits;
+	last = (iomap->offset + iomap->length - 1) >> inode->i_blkbits;
+	if (first <= last) {
+		down_write(&ci->map_sem);
+		ouichefs_delayed_release(inode, first, last);
+		up_write(&ci->map_sem);
 	}
 
-	char *buffer = bh->b_data;
+	return 0;
+}
+
+static const struct iomap_ops ouichefs_iomap_ops = {
+	.iomap_begin = ouichefs_iomap_begin,
+	.iomap_end = ouichefs_iomap_end,
+};
 
-	/* get data from the buffer from the current position */
-	buffer += *pos % OUICHEFS_BLOCK_SIZE;
+/* Maximum number of delayed blocks allocated at once by writeback */
+#define OUICHEFS_DELAYED_WINDOW 1024
 
-	if (bh->b_size < len)
-		to_be_copied = bh->b_size;
-	else
-		to_be_copied = len;
+/*
+ * Called by iomap writeback to map the dirty block of a file at offset. The
+ * mapping is kept in wpc->iomap and reused for the following blocks it
+ * covers. Delayed blocks are allocated here, one extent for the whole run of
+ * contiguous delayed blocks, so that a file written sequentially stays
+ * contiguous and is written with large bios. Unwritten blocks stay unwritten
+ * until their data is on the disk (see ouichefs_end_ioend()), as their
+ * neighbours may not be dirty. A block of a hole without a reservation was
+ * not written (e.g. the rest of a large folio) and is reported as a hole,
+ * which writeback skips, so sparse files stay sparse. The delayed blocks that
+ * were allocated meanwhile (e.g. by a direct write racing with a write to a
+ * mapping of the file, see ouichefs_dio_map()) just have their reservation
+ * released.
+ */
+static int ouichefs_map_blocks(struct iomap_writepage_ctx *wpc,
+			       struct inode *inode, loff_t offset)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	sector_t iblock = offset >> inode->i_blkbits;
+	uint32_t entry, len;
+	int ret;
 
-	copied_to_user =
-		to_be_copied - copy_to_user(data, buffer, to_be_copied);
+	if ((wpc->iomap.type == IOMAP_MAPPED ||
+	     wpc->iomap.type == IOMAP_UNWRITTEN) &&
+	    offset >= wpc->iomap.offset &&
+	    offset < wpc->iomap.offset + wpc->iomap.length)
+		return 0;
 
-	*pos += copied_to_user;
-	file->f_pos = *pos;
+	down_write(&ci->map_sem);
+	ret = ouichefs_map_lookup(inode, iblock, OUICHEFS_DELAYED_WINDOW,
+				  &entry, &len);
+	if (ret)
+		goto unlock;
+	if (!entry) {
+		len = ouichefs_delayed_run(inode, iblock, len);
+		if (!len) {
+			/* Not reserved, so not written: leave the hole alone */
+			ouichefs_set_iomap(inode, &wpc->iomap, iblock, 0, 1);
+			goto unlock;
+		}
+		ret = ouichefs_alloc_hole(inode, iblock, &entry, &len, 0);
+		if (ret)
+			goto unlock;
+	}
+	ouichefs_delayed_release(inode, iblock, iblock + len - 1);
+	ouichefs_set_iomap(inode, &wpc->iomap, iblock, entry, len);
 
-	brelse(bh);
-	brelse(bh_index);
+unlock:
+	up_write(&ci->map_sem);
 
-	return copied_to_user;
+	return ret;
 }
 
 /*
- * Read function for the ouichefs filesystem. This function allows to read data
- * without the use of page cache. This read function is the one that reads data
- * written with ouichefs_write_insert function.
- *
- * In insert mode, blocks are numbered as follows in the index block:
- *	- The 12 most significant bits represent the size of the block
- *	- The 20 least significant bits represent the block number
+ * Mark the unwritten blocks of an ioend as written now that its data is on the
+ * disk, then end the writeback of its folios. A failed conversion is reported
+ * as a writeback error (see filemap_check_errors()).
  */
-static ssize_t ouichefs_read_insert(struct file *file, char __user *data,
-				    size_t len, loff_t *pos)
+static void ouichefs_end_ioend(struct iomap_ioend *ioend)
 {
-	if (file->f_flags & O_WRONLY)
-		return -EBADF;
+	struct inode *inode = ioend->io_inode;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	int error = blk_status_to_errno(ioend->io_bio->bi_status);
+	sector_t first = ioend->io_offset >> inode->i_blkbits;
+	sector_t last = (ioend->io_offset + ioend->io_size - 1) >>
+			inode->i_blkbits;
+
+	if (!error) {
+		down_write(&ci->map_sem);
+		error = ouichefs_map_convert(inode, first, last);
+		up_write(&ci->map_sem);
+		if (error)
+			pr_err("inode %lu: unwritten blocks not converted\n",
+			       inode->i_ino);
+	}
+	iomap_finish_ioends(ioend, error);
+}
 
-	if (*pos >= file->f_inode->i_size)
-		return 0;
+/*
+ * Convert the completed unwritten ioends of a file. Contiguous ioends are
+ * merged first, so that their blocks are converted at once.
+ */
+static void ouichefs_ioend_work(struct work_struct *work)
+{
+	struct ouichefs_inode_info *ci =
+		container_of(work, struct ouichefs_inode_info, ioend_work);
+	struct iomap_ioend *ioend;
+	struct list_head ioends;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ci->ioend_lock, flags);
+	list_replace_init(&ci->ioend_list, &ioends);
+	spin_unlock_irqrestore(&ci->ioend_lock, flags);
+
+	iomap_sort_ioends(&ioends);
+	while ((ioend = list_first_entry_or_null(&ioends, struct iomap_ioend,
+						 io_list))) {
+		list_del_init(&ioend->io_list);
+		iomap_ioend_try_merge(ioend, &ioends);
+		ouichefs_end_ioend(ioend);
+		cond_resched();
+	}
+}
 
-	unsigned long to_be_copied = 0;
-	unsigned long copied_to_user = 0;
+void ouichefs_ioend_init(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 
-	struct super_block *sb = file->f_inode->i_sb;
-	sector_t iblock;
-	struct ouichefs_file_index_block *index;
-	struct buffer_head *bh_index;
-	struct ouichefs_inode_info *ci = OUICHEFS_INODE(file->f_inode);
+	spin_lock_init(&ci->ioend_lock);
+	INIT_LIST_HEAD(&ci->ioend_list);
+	INIT_WORK(&ci->ioend_work, ouichefs_ioend_work);
+}
 
-	/* Read index block from disk */
-	bh_index = sb_bread(sb, ci->index_block);
-	if (!bh_index)
-		return -EIO;
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+/*
+ * Bio completion of an unwritten ioend, in interrupt context: the blocks are
+ * converted by ouichefs_ioend_work(), which can sleep.
+ */
+static void ouichefs_end_bio(struct bio *bio)
+{
+	struct iomap_ioend *ioend = bio->bi_private;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(ioend->io_inode);
+	unsigned long flags;
+
+	spin_lock_irqsave(&ci->ioend_lock, flags);
+	if (list_empty(&ci->ioend_list))
+		queue_work(system_unbound_wq, &ci->ioend_work);
+	list_add_tail(&ioend->io_list, &ci->ioend_list);
+	spin_unlock_irqrestore(&ci->ioend_lock, flags);
+}
 
-	loff_t pos_in_block =
-		ouichefs_find_block(file->f_inode, pos, &iblock, index, 0);
+/* Called by iomap before submitting an ioend */
+static int ouichefs_prepare_ioend(struct iomap_ioend *ioend, int status)
+{
+	if (!status && ioend->io_type == IOMAP_UNWRITTEN)
+		ioend->io_bio->bi_end_io = ouichefs_end_bio;
 
-	/* If block number exceeds filesize, fail */
-	if (iblock >= OUICHEFS_BLOCK_SIZE >> 2)
-		return -EFBIG;
+	return status;
+}
 
-	/* Get the block number for the current iblock */
-	uint32_t bno = index->blocks[iblock];
-	uint32_t size_block = (bno >> 20);
-	uint32_t block_number = (bno & 0x000FFFFF);
+static const struct iomap_writeback_ops ouichefs_writeback_ops = {
+	.map_blocks = ouichefs_map_blocks,
+	.prepare_ioend = ouichefs_prepare_ioend,
+};
 
-	if (bno == 0) {
-		brelse(bh_index);
-		return -EIO;
+/*
+ * Fill the locked folio of an inline file with the data in the inode. Return
+ * false if the file is not inline. The folio may be larger than a page, but
+ * the inline data always fits in its first page.
+ */
+static bool ouichefs_read_inline_folio(struct inode *inode,
+				       struct folio *folio)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	size_t len = 0;
+	char *kaddr;
+
+	down_read(&ci->map_sem);
+	if (!ouichefs_is_inline(inode)) {
+		up_read(&ci->map_sem);
+		return false;
 	}
+	if (!folio->index)
+		len = min_t(loff_t, i_size_read(inode), OUICHEFS_INLINE_SIZE);
+	kaddr = kmap_local_folio(folio, 0);
+	memcpy(kaddr, ci->i_inline, len);
+	kunmap_local(kaddr);
+	up_read(&ci->map_sem);
 
-	struct buffer_head *bh = sb_bread(sb, block_number);
+	folio_zero_range(folio, len, folio_size(folio) - len);
+	folio_mark_uptodate(folio);
 
-	if (!bh) {
-		brelse(bh_index);
-		return -EIO;
+	return true;
+}
+
+/*
+ * Copy len bytes from a buffer to a folio at offset, one page at a time.
+ */
+static void ouichefs_copy_to_folio(struct folio *folio, size_t offset,
+				   const char *from, size_t len)
+{
+	size_t n;
+	char *kaddr;
+
+	while (len) {
+		n = min_t(size_t, len, PAGE_SIZE - offset_in_page(offset));
+		kaddr = kmap_local_folio(folio, offset);
+		memcpy(kaddr, from, n);
+		kunmap_local(kaddr);
+		offset += n;
+		from += n;
+		len -= n;
+	}
+}
+
+/*
+ * Fill the locked folio of an insert mode file with its data. The bytes of the
+ * folio are spread over variable-size blocks, which are copied one after the
+ * other (holes are zeroes), so the folio cannot be read with a bio.
+ */
+static int ouichefs_read_insert_folio(struct inode *inode,
+				      struct folio *folio)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index, *bh;
+	loff_t start = folio_pos(folio), pos = start, end;
+	uint32_t entry, size, bno;
+	sector_t iblock;
+	size_t off, n;
+	int ret = 0;
+
+	end = min_t(loff_t, start + folio_size(folio), i_size_read(inode));
+
+	down_read(&ci->map_sem);
+	index = ouichefs_index_cache_get(inode, &bh_index);
+	if (!index) {
+		ret = -EIO;
+		goto unlock;
+	}
+	while (pos < end) {
+		off = ouichefs_find_block(inode, &pos, &iblock, index, 0);
+		if (iblock >= OUICHEFS_PTRS)
+			break;
+		entry = index->blocks[iblock];
+		size = entry >> 20;
+		bno = entry & 0x000FFFFF;
+		if (!entry || off >= size)
+			break;
+		n = min_t(loff_t, size - off, end - pos);
+		if (!bno) {
+			folio_zero_range(folio, pos - start, n);
+		} else {
+			bh = sb_bread(inode->i_sb, bno);
+			if (!bh) {
+				ret = -EIO;
+				break;
+			}
+			ouichefs_copy_to_folio(folio, pos - start,
+					       bh->b_data + off, n);
+			brelse(bh);
+		}
+		pos += n;
+	}
+	brelse(bh_index);
+unlock:
+	up_read(&ci->map_sem);
+	if (ret)
+		return ret;
+
+	folio_zero_range(folio, pos - start, folio_size(folio) - (pos - start));
+	flush_dcache_folio(folio);
+	folio_mark_uptodate(folio);
+
+	return 0;
+}
+
+/*
+ * Called by the page cache to read a folio that readahead did not read.
+ */
+static int ouichefs_read_folio(struct file *file, struct folio *folio)
+{
+	struct inode *inode = folio->mapping->host;
+	int ret;
+
+	if (ouichefs_read_inline_folio(inode, folio)) {
+		folio_unlock(folio);
+		return 0;
+	}
+	if (ouichefs_insert_mode(inode)) {
+		ret = ouichefs_read_insert_folio(inode, folio);
+		folio_unlock(folio);
+		return ret;
 	}
 
-	char *buffer = bh->b_data;
+	return iomap_read_folio(folio, &ouichefs_iomap_ops);
+}
 
-	/* get data from the buffer from the current position */
-	buffer += pos_in_block;
+/*
+ * Called by the page cache to read pages from the physical disk and map them
+ * in memory. Inline files have a single folio of data, left to read_folio.
+ * The folios of insert mode files are filled one by one.
+ */
+static void ouichefs_readahead(struct readahead_control *rac)
+{
+	struct inode *inode = rac->mapping->host;
+	struct folio *folio;
+
+	if (ouichefs_is_inline(inode))
+		return;
+	if (ouichefs_insert_mode(inode)) {
+		while ((folio = readahead_folio(rac))) {
+			ouichefs_read_insert_folio(inode, folio);
+			folio_unlock(folio);
+		}
+		return;
+	}
+
+	iomap_readahead(rac, &ouichefs_iomap_ops);
+}
+
+/*
+ * Called by the page cache to write the dirty pages of a file (when sync is
+ * called or when memory is needed). Delayed blocks get allocated on the way
+ * (see ouichefs_map_blocks()). iomap walks the dirty folios in index order,
+ * within wbc->nr_to_write and waiting for folios under writeback only for
+ * WB_SYNC_ALL, and adds physically contiguous blocks to the same bio. The
+ * plug lets the block layer merge the bios of a file before dispatching them,
+ * also on the fsync() path where the flusher's plug is not there.
+ */
+static int ouichefs_writepages(struct address_space *mapping,
+			       struct writeback_control *wbc)
+{
+	struct iomap_writepage_ctx wpc = {};
+	struct blk_plug plug;
+	int ret;
+
+	blk_start_plug(&plug);
+	ret = iomap_writepages(mapping, wbc, &wpc, &ouichefs_writeback_ops);
+	blk_finish_plug(&plug);
+
+	return ret;
+}
+
+const struct address_space_operations ouichefs_aops = {
+	.read_folio = ouichefs_read_folio,
+	.readahead = ouichefs_readahead,
+	.writepages = ouichefs_writepages,
+	.dirty_folio = filemap_dirty_folio,
+	.release_folio = iomap_release_folio,
+	.invalidate_folio = iomap_invalidate_folio,
+	.migrate_folio = filemap_migrate_folio,
+	.is_partially_uptodate = iomap_is_partially_uptodate,
+	.error_remove_page = generic_error_remove_page,
+};
+
+static int ouichefs_open(struct inode *inode, struct file *file)
+{
+	bool wronly = (file->f_flags & O_WRONLY) != 0;
+	bool rdwr = (file->f_flags & O_RDWR) != 0;
+	bool trunc = (file->f_flags & O_TRUNC) != 0;
+	struct ouichefs_ra_state *ra;
+	int ret;
+
+	/* Allocated first, a failed open must not have truncated the file */
+	ra = kzalloc(sizeof(*ra), GFP_KERNEL);
+	if (!ra)
+		return -ENOMEM;
+	spin_lock_init(&ra->lock);
+
+	if ((wronly || rdwr) && trunc &&
+	    (inode->i_size != 0 ||
+	     inode->i_blocks > (OUICHEFS_INODE(inode)->index_block ? 1 : 0))) {
+		struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+		/* Drop the page cache and its delayed blocks first */
+		truncate_pagecache(inode, 0);
+
+		down_write(&ci->map_sem);
+		ret = ouichefs_map_truncate(inode, false);
+		up_write(&ci->map_sem);
+		if (ret) {
+			kfree(ra);
+			return ret;
+		}
+		inode->i_size = 0;
+		mark_inode_dirty(inode);
+	}
+	/* Direct I/O is done through iomap */
+	file->f_mode |= FMODE_CAN_ODIRECT;
+	file->private_data = ra;
+
+	return 0;
+}
+
+/*
+ * Read from a file (read_iter, used by readv(), aio, splice...). O_DIRECT
+ * reads go from the disk to the user buffer, after the dirty cached pages of
+ * the range are written back. Inline files have no block to read from, and
+ * insert mode files no block aligned data: they are always read through the
+ * page cache.
+ */
+static ssize_t ouichefs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	if (!(iocb->ki_flags & IOCB_DIRECT))
+		return generic_file_read_iter(iocb, to);
+	if (!iov_iter_count(to))
+		return 0;
+
+	inode_lock_shared(inode);
+	if (ouichefs_is_inline(inode) || ouichefs_insert_mode(inode)) {
+		iocb->ki_flags &= ~IOCB_DIRECT;
+		ret = generic_file_read_iter(iocb, to);
+		iocb->ki_flags |= IOCB_DIRECT;
+	} else {
+		ret = iomap_dio_rw(iocb, to, &ouichefs_iomap_ops, NULL, 0,
+				   NULL, 0);
+	}
+	inode_unlock_shared(inode);
+
+	return ret;
+}
+
+/*
+ * Called when a direct write completes, before ki_pos is moved past the data:
+ * mark the unwritten blocks written to as written, and extend the file to the
+ * end of the data written. Only the blocks actually written are converted, the
+ * others still read as zeroes.
+ */
+static int ouichefs_dio_write_end_io(struct kiocb *iocb, ssize_t size,
+				     int error, unsigned int flags)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	int ret;
+
+	if (error)
+		return error;
+	if (size > 0 && (flags & IOMAP_DIO_UNWRITTEN)) {
+		down_write(&ci->map_sem);
+		ret = ouichefs_map_convert(inode,
+					   iocb->ki_pos >> inode->i_blkbits,
+					   (iocb->ki_pos + size - 1) >>
+						   inode->i_blkbits);
+		up_write(&ci->map_sem);
+		if (ret)
+			return ret;
+	}
+	if (size > 0 && iocb->ki_pos + size > i_size_read(inode)) {
+		i_size_write(inode, iocb->ki_pos + size);
+		mark_inode_dirty(inode);
+	}
+
+	return 0;
+}
+
+static const struct iomap_dio_ops ouichefs_dio_write_ops = {
+	.end_io = ouichefs_dio_write_end_io,
+};
+
+/*
+ * Write a file directly to the disk, with the inode lock held. Direct writes
+ * must be aligned on the logical block size of the device, like for other
+ * filesystems. Those that do not cover whole file blocks go through the page
+ * cache, which reads and merges the partial blocks, and are then written
+ * back and dropped, as are writes whose cached pages could not be
+ * invalidated. Writes extending the file wait for completion, so that i_size
+ * is updated under the inode lock.
+ */
+static ssize_t ouichefs_dio_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	unsigned int dio_flags = 0;
+	size_t count = iov_iter_count(from);
+	loff_t pos = iocb->ki_pos;
+	ssize_t ret;
+	int err;
+
+	if ((pos | count) & (bdev_logical_block_size(inode->i_sb->s_bdev) - 1))
+		return -EINVAL;
+	if (pos + count > i_size_read(inode))
+		dio_flags |= IOMAP_DIO_FORCE_WAIT;
+
+	if ((pos | count) & (OUICHEFS_BLOCK_SIZE - 1))
+		ret = -ENOTBLK;
+	else
+		ret = iomap_dio_rw(iocb, from, &ouichefs_iomap_ops,
+				   &ouichefs_dio_write_ops, dio_flags, NULL, 0);
+	if (ret != -ENOTBLK)
+		return ret;
+
+	/* Write the data back and drop it, as a direct write would */
+	ret = iomap_file_buffered_write(iocb, from, &ouichefs_iomap_ops);
+	if (ret <= 0)
+		return ret;
+	err = filemap_write_and_wait_range(inode->i_mapping, pos,
+					   pos + ret - 1);
+	if (err)
+		return err;
+	invalidate_mapping_pages(inode->i_mapping, pos >> PAGE_SHIFT,
+				 (pos + ret - 1) >> PAGE_SHIFT);
+
+	return ret;
+}
+
+static ssize_t ouichefs_write_insert_iter(struct file *file,
+					  struct iov_iter *from, loff_t *pos);
+
+/*
+ * Write to a file (write_iter, used by writev(), aio, splice...). Buffered
+ * writes go through the page cache: the blocks of the written range are
+ * reserved, and allocated at writeback. O_DIRECT writes go straight to the
+ * disk (see ouichefs_dio_write()). Insert mode files are written in insert
+ * mode, like with write().
+ */
+static ssize_t ouichefs_file_write_iter(struct kiocb *iocb,
+					struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	if (ouichefs_insert_mode(inode))
+		return ouichefs_write_insert_iter(iocb->ki_filp, from,
+						  &iocb->ki_pos);
+
+	inode_lock(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto unlock;
+	ret = file_remove_privs(iocb->ki_filp);
+	if (ret)
+		goto unlock;
+	ret = file_update_time(iocb->ki_filp);
+	if (ret)
+		goto unlock;
+	if (iocb->ki_flags & IOCB_DIRECT)
+		ret = ouichefs_dio_write(iocb, from);
+	else
+		ret = iomap_file_buffered_write(iocb, from,
+						&ouichefs_iomap_ops);
+
+unlock:
+	inode_unlock(inode);
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+
+	return ret;
+}
+
+/*
+ * read() and write() through read_iter and write_iter: the only paths doing
+ * direct I/O, and reading insert mode files through the page cache.
+ */
+static ssize_t ouichefs_iter_rw(struct file *file, char __user *data,
+				size_t len, loff_t *pos, bool write)
+{
+	struct kiocb kiocb;
+	struct iov_iter iter;
+	ssize_t ret;
+
+	init_sync_kiocb(&kiocb, file);
+	kiocb.ki_pos = *pos;
+	iov_iter_ubuf(&iter, write ? ITER_SOURCE : ITER_DEST, data, len);
+	if (write)
+		ret = ouichefs_file_write_iter(&kiocb, &iter);
+	else
+		ret = ouichefs_file_read_iter(&kiocb, &iter);
+	*pos = kiocb.ki_pos;
+
+	return ret;
+}
+
+/*
+ * Called before a page of a shared file mapping is written to: reserve its
+ * blocks as a buffered write would. Insert mode data only changes through
+ * insertions, not by writing to pages in place.
+ */
+static vm_fault_t ouichefs_page_mkwrite(struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	vm_fault_t ret;
+
+	if (ouichefs_insert_mode(inode))
+		return VM_FAULT_SIGBUS;
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vmf->vma->vm_file);
+	ret = iomap_page_mkwrite(vmf, &ouichefs_iomap_ops);
+	sb_end_pagefault(inode->i_sb);
+
+	return ret;
+}
+
+static const struct vm_operations_struct ouichefs_file_vm_ops = {
+	.fault = filemap_fault,
+	.map_pages = filemap_map_pages,
+	.page_mkwrite = ouichefs_page_mkwrite,
+};
+
+/*
+ * Map a file in memory, through the page cache. Insert mode files can only be
+ * mapped read-only or privately (see ouichefs_page_mkwrite()).
+ */
+static int ouichefs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	if (ouichefs_insert_mode(file_inode(file)) &&
+	    (vma->vm_flags & VM_SHARED) && (vma->vm_flags & VM_WRITE))
+		return -EACCES;
+
+	file_accessed(file);
+	vma->vm_ops = &ouichefs_file_vm_ops;
+
+	return 0;
+}
+
+/*
+ * Called when the last reference to an open file is dropped: give the
+ * preallocation window of the inode back.
+ */
+static int ouichefs_release(struct inode *inode, struct file *file)
+{
+	if (file->f_mode & FMODE_WRITE)
+		ouichefs_prealloc_discard(inode);
+	kfree(file->private_data);
+
+	return 0;
+}
+
+int ouichefs_ra_init(struct ouichefs_sb_info *sbi)
+{
+	int ret;
+
+	ret = percpu_counter_init(&sbi->ra_hits, 0, GFP_KERNEL);
+	if (ret)
+		return ret;
+	ret = percpu_counter_init(&sbi->ra_misses, 0, GFP_KERNEL);
+	if (ret)
+		percpu_counter_destroy(&sbi->ra_hits);
+
+	return ret;
+}
+
+void ouichefs_ra_destroy(struct ouichefs_sb_info *sbi)
+{
+	percpu_counter_destroy(&sbi->ra_misses);
+	percpu_counter_destroy(&sbi->ra_hits);
+}
+
+/*
+ * sb_bread() for the reads that do not go through the page cache. A block that
+ * is already in memory (read ahead or cached), or whose read ahead completes
+ * while waiting for it, is a readahead hit, a block read now is a miss.
+ */
+static struct buffer_head *ouichefs_ra_bread(struct super_block *sb,
+					     uint32_t bno)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct buffer_head *bh;
+	int ret;
+
+	bh = sb_getblk(sb, bno);
+	if (!bh)
+		return NULL;
+	ret = buffer_uptodate(bh) ? 1 : bh_read(bh, 0);
+	if (ret < 0) {
+		brelse(bh);
+		return NULL;
+	}
+	percpu_counter_inc(ret ? &sbi->ra_hits : &sbi->ra_misses);
+
+	return bh;
+}
+
+/*
+ * Read ahead the blocks of a normal mode file between the file offsets start
+ * and end, one run of mapped blocks at a time.
+ */
+static void ouichefs_ra_flat(struct inode *inode, loff_t start, loff_t end)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	sector_t iblock = start / OUICHEFS_BLOCK_SIZE;
+	sector_t last = (end - 1) / OUICHEFS_BLOCK_SIZE;
+	uint32_t bno, nr, i;
+
+	while (iblock <= last && iblock < OUICHEFS_MAP_BLOCKS) {
+		down_read(&ci->map_sem);
+		if (ouichefs_map_lookup(inode, iblock, last - iblock + 1, &bno,
+					&nr)) {
+			up_read(&ci->map_sem);
+			return;
+		}
+		up_read(&ci->map_sem);
+		if (bno && !(bno & OUICHEFS_UNWRITTEN)) {
+			for (i = 0; i < nr; i++)
+				sb_breadahead(inode->i_sb, bno + i);
+		}
+		iblock += nr;
+	}
+}
+
+/*
+ * Read ahead the blocks of an insert mode file holding the data between the
+ * file offsets start and end.
+ */
+static void ouichefs_ra_insert(struct inode *inode, loff_t start, loff_t end)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index;
+	sector_t iblock;
+	uint32_t entry;
+	loff_t pos;
+
+	down_read(&ci->map_sem);
+	index = ouichefs_index_cache_get(inode, &bh_index);
+	if (!index)
+		goto unlock;
+	pos = start - ouichefs_find_block(inode, &start, &iblock, index, 0);
+	for (; pos < end && iblock < OUICHEFS_PTRS; iblock++) {
+		entry = index->blocks[iblock];
+		if (!entry)
+			break;
+		if (entry & 0x000FFFFF)
+			sb_breadahead(inode->i_sb, entry & 0x000FFFFF);
+		pos += entry >> 20;
+	}
+	brelse(bh_index);
+unlock:
+	up_read(&ci->map_sem);
+}
+
+/*
+ * Called before a read of [pos, end) that does not go through the page cache:
+ * update the readahead window of the file and, for sequential reads, read
+ * ahead asynchronously the data that follows, except what was already read
+ * ahead by previous reads.
+ */
+static void ouichefs_ra_start(struct file *file, loff_t pos, loff_t end,
+			      bool insert)
+{
+	struct ouichefs_ra_state *ra = file->private_data;
+	struct inode *inode = file_inode(file);
+	loff_t start, stop;
+
+	spin_lock(&ra->lock);
+	if (pos != ra->next) {
+		ra->window = 0;
+		ra->ahead = 0;
+		spin_unlock(&ra->lock);
+		return;
+	}
+	ra->window = ra->window ? min(ra->window * 2, OUICHEFS_RA_MAX) :
+				  OUICHEFS_RA_MIN;
+
+	start = max(end, ra->ahead);
+	stop = min_t(loff_t, end + (loff_t)ra->window * OUICHEFS_BLOCK_SIZE,
+		     i_size_read(inode));
+	if (start < stop)
+		ra->ahead = stop;
+	spin_unlock(&ra->lock);
+
+	if (start >= stop)
+		return;
+	if (insert)
+		ouichefs_ra_insert(inode, start, stop);
+	else
+		ouichefs_ra_flat(inode, start, stop);
+}
+
+/* Called after a read that does not go through the page cache, ending at pos */
+static void ouichefs_ra_end(struct file *file, loff_t pos)
+{
+	struct ouichefs_ra_state *ra = file->private_data;
+
+	spin_lock(&ra->lock);
+	ra->next = pos;
+	spin_unlock(&ra->lock);
+}
+
+/* Number of blocks read ahead of the one being copied to the user */
+#define OUICHEFS_READ_AHEAD 32
+
+/*
+ * Copy len bytes to a user buffer from the physically contiguous blocks
+ * starting at bno, from offset off in the first one. The following blocks of
+ * the run are read ahead, so that the device reads them while the first ones
+ * are copied.
+ *
+ * Return: the number of bytes copied, short on a fault, or -EIO if the first
+ * block could not be read.
+ */
+static ssize_t ouichefs_read_run(struct super_block *sb, char __user *data,
+				 uint32_t bno, size_t off, size_t len)
+{
+	uint32_t i, nr = DIV_ROUND_UP(off + len, OUICHEFS_BLOCK_SIZE);
+	struct buffer_head *bh;
+	size_t copied = 0, n, left;
+
+	for (i = 1; i < min_t(uint32_t, nr, OUICHEFS_READ_AHEAD + 1); i++)
+		sb_breadahead(sb, bno + i);
+
+	for (i = 0; i < nr; i++) {
+		if (i + OUICHEFS_READ_AHEAD + 1 < nr)
+			sb_breadahead(sb, bno + i + OUICHEFS_READ_AHEAD + 1);
+		bh = ouichefs_ra_bread(sb, bno + i);
+		if (!bh)
+			return copied ? copied : -EIO;
+		n = min_t(size_t, len - copied, OUICHEFS_BLOCK_SIZE - off);
+		left = copy_to_user(data + copied, bh->b_data + off, n);
+		brelse(bh);
+		copied += n - left;
+		if (left)
+			break;
+		off = 0;
+	}
+
+	return copied;
+}
+
+/*
+ * Read data without the use of page cache, with the inode lock held. The user
+ * buffer is filled in a single call, one run of contiguous blocks at a time.
+ */
+static ssize_t __ouichefs_read(struct file *file, char __user *data,
+			       size_t len, loff_t *pos)
+{
+	if (*pos >= file->f_inode->i_size)
+		return 0;
+
+	unsigned long to_be_copied = 0;
+	unsigned long copied_to_user = 0;
+
+	struct super_block *sb = file->f_inode->i_sb;
+	sector_t iblock = *pos / OUICHEFS_BLOCK_SIZE;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(file->f_inode);
+	uint32_t bno, nr;
+	int ret = 0;
+
+	/* If block number exceeds filesize, fail */
+	if (iblock >= OUICHEFS_MAP_BLOCKS)
+		return -EFBIG;
+
+	/* Les fichiers inline sont lus directement depuis l'inode */
+	down_read(&ci->map_sem);
+	if (ouichefs_is_inline(file->f_inode)) {
+		char buffer[OUICHEFS_INLINE_SIZE];
+		loff_t size = min_t(loff_t, file->f_inode->i_size,
+				    OUICHEFS_INLINE_SIZE);
+
+		to_be_copied = *pos < size ? min_t(loff_t, len, size - *pos) :
+					     0;
+		memcpy(buffer, ci->i_inline + *pos, to_be_copied);
+		up_read(&ci->map_sem);
+
+		copied_to_user = to_be_copied -
+				 copy_to_user(data, buffer, to_be_copied);
+		*pos += copied_to_user;
+		file->f_pos = *pos;
+		return copied_to_user;
+	}
+	up_read(&ci->map_sem);
+
+	/* Do not read past the end of the file */
+	len = min_t(loff_t, len, file->f_inode->i_size - *pos);
+	ouichefs_ra_start(file, *pos, *pos + len, false);
+
+	while (copied_to_user < len) {
+		size_t off = *pos % OUICHEFS_BLOCK_SIZE;
+		ssize_t copied;
+
+		/* Get the run of blocks mapped like the current iblock */
+		iblock = *pos / OUICHEFS_BLOCK_SIZE;
+		if (iblock >= OUICHEFS_MAP_BLOCKS) {
+			ret = -EFBIG;
+			break;
+		}
+		down_read(&ci->map_sem);
+		ret = ouichefs_map_lookup(file->f_inode, iblock,
+					  DIV_ROUND_UP(off + len -
+						       copied_to_user,
+						       OUICHEFS_BLOCK_SIZE),
+					  &bno, &nr);
+		up_read(&ci->map_sem);
+		if (ret)
+			break;
+
+		to_be_copied = min_t(unsigned long, len - copied_to_user,
+				     (unsigned long)nr * OUICHEFS_BLOCK_SIZE -
+				     off);
+
+		/*
+		 * Holes and unwritten blocks read as zeroes, the content of the
+		 * latter on disk is stale
+		 */
+		if (!bno || (bno & OUICHEFS_UNWRITTEN))
+			copied = to_be_copied -
+				 clear_user(data + copied_to_user,
+					    to_be_copied);
+		else
+			copied = ouichefs_read_run(sb, data + copied_to_user,
+						   bno, off, to_be_copied);
+		if (copied < 0) {
+			ret = copied;
+			break;
+		}
+
+		*pos += copied;
+		copied_to_user += copied;
+		if (copied < to_be_copied)
+			break;
+	}
+	file->f_pos = *pos;
+	ouichefs_ra_end(file, *pos);
+
+	return copied_to_user ? copied_to_user : ret;
+}
+
+/*
+ * Read function for the ouichefs filesystem. This function allows to read data
+ * without the use of page cache (see __ouichefs_read()), except for O_DIRECT.
+ * The dirty pages of the range read are written first, so that the blocks
+ * hold the data of the earlier buffered writes and of the writes to a mapping
+ * of the file.
+ */
+static ssize_t ouichefs_read(struct file *file, char __user *data, size_t len,
+			     loff_t *pos)
+{
+	struct inode *inode = file->f_inode;
+	ssize_t ret;
+
+	if (file->f_flags & O_WRONLY)
+		return -EBADF;
+
+	if (file->f_flags & O_DIRECT)
+		return ouichefs_iter_rw(file, data, len, pos, false);
+
+	if (!len)
+		return 0;
+
+	inode_lock_shared(inode);
+	ret = filemap_write_and_wait_range(inode->i_mapping, *pos,
+					   *pos + len - 1);
+	if (!ret)
+		ret = __ouichefs_read(file, data, len, pos);
+	inode_unlock_shared(inode);
+
+	return ret;
+}
+
+/*
+ * Read function for the ouichefs filesystem. This read function is the one that
+ * reads data written with ouichefs_write_insert function: through the page
+ * cache (see ouichefs_read_insert_folio()), or without it for O_DIRECT.
+ *
+ * In insert mode, blocks are numbered as follows in the index block:
+ *	- The 12 most significant bits represent the size of the block
+ *	- The 20 least significant bits represent the block number
+ */
+ssize_t ouichefs_read_insert(struct file *file, char __user *data, size_t len,
+			     loff_t *pos)
+{
+	/* Fichiers au format extents ou trop gros : pas de mode insertion */
+	if (!ouichefs_insert_capable(file->f_inode))
+		return ouichefs_read(file, data, len, pos);
+
+	if (file->f_flags & O_WRONLY)
+		return -EBADF;
+
+	/* Hors O_DIRECT, les données sont lues depuis le page cache */
+	if (!(file->f_flags & O_DIRECT))
+		return ouichefs_iter_rw(file, data, len, pos, false);
+
+	if (*pos >= file->f_inode->i_size)
+		return 0;
+
+	unsigned long to_be_copied = 0;
+	unsigned long copied_to_user = 0;
+
+	struct super_block *sb = file->f_inode->i_sb;
+	sector_t iblock;
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh_index;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(file->f_inode);
+	int ret = 0;
+
+	/* Ne pas lire au-delà de la fin du fichier */
+	len = min_t(loff_t, len, file->f_inode->i_size - *pos);
+	ouichefs_ra_start(file, *pos, *pos + len, true);
+
+	while (copied_to_user < len) {
+		uint32_t entries[OUICHEFS_READ_AHEAD];
+		uint32_t i, nr;
+		loff_t pos_in_block;
+
+		/*
+		 * Lire l'index depuis sa copie en mémoire (ou le disque) et
+		 * en copier les entrées des prochains blocs : map_sem n'est
+		 * pas gardé pendant les copies vers l'utilisateur, qui
+		 * peuvent provoquer des fautes de page.
+		 */
+		down_read(&ci->map_sem);
+		index = ouichefs_index_cache_get(file->f_inode, &bh_index);
+		if (!index) {
+			up_read(&ci->map_sem);
+			ret = -EIO;
+			break;
+		}
+		pos_in_block = ouichefs_find_block(file->f_inode, pos, &iblock,
+						   index, 0);
+
+		/* If block number exceeds filesize, fail */
+		if (iblock >= OUICHEFS_BLOCK_SIZE >> 2) {
+			brelse(bh_index);
+			up_read(&ci->map_sem);
+			ret = -EFBIG;
+			break;
+		}
+		nr = min_t(sector_t, OUICHEFS_READ_AHEAD,
+			   (OUICHEFS_BLOCK_SIZE >> 2) - iblock);
+		memcpy(entries, &index->blocks[iblock], nr * sizeof(*entries));
+		brelse(bh_index);
+		up_read(&ci->map_sem);
+
+		/* Lire en avance les blocs suivants */
+		for (i = 1; i < nr && entries[i]; i++) {
+			if (entries[i] & 0x000FFFFF)
+				sb_breadahead(sb, entries[i] & 0x000FFFFF);
+		}
+
+		/* Copier les blocs jusqu'à remplir le buffer */
+		for (i = 0; i < nr && copied_to_user < len; i++) {
+			uint32_t size_block = (entries[i] >> 20);
+			uint32_t block_number = (entries[i] & 0x000FFFFF);
+			unsigned long copied;
+
+			if (entries[i] == 0) {
+				ret = -EIO;
+				break;
+			}
+			if (pos_in_block >= size_block) {
+				pos_in_block = 0;
+				continue;
+			}
+			to_be_copied = min_t(unsigned long,
+					     size_block - pos_in_block,
+					     len - copied_to_user);
+
+			/* Un trou (pas de bloc) se lit comme des zéros */
+			if (block_number == 0) {
+				copied = to_be_copied -
+					 clear_user(data + copied_to_user,
+						    to_be_copied);
+			} else {
+				struct buffer_head *bh =
+					ouichefs_ra_bread(sb, block_number);
+
+				if (!bh) {
+					ret = -EIO;
+					break;
+				}
+
+				/* get data from the current position */
+				copied = to_be_copied -
+					 copy_to_user(data + copied_to_user,
+						      bh->b_data + pos_in_block,
+						      to_be_copied);
+				brelse(bh);
+			}
+
+			*pos += copied;
+			copied_to_user += copied;
+			if (copied < to_be_copied) {
+				ret = -EFAULT;
+				break;
+			}
+			pos_in_block = 0;
+		}
+		if (ret)
+			break;
+	}
+	file->f_pos = *pos;
+	ouichefs_ra_end(file, *pos);
+
+	return copied_to_user ? copied_to_user : ret;
+}
+
+/*
+ * Write data without the use of page cache, with the inode lock held.
+ */
+static ssize_t __ouichefs_write(struct file *file, const char __user *data,
+				size_t len, loff_t *pos)
+{
+	struct inode *inode = file->f_inode;
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh;
+	char *buffer;
+	size_t to_be_written, written = 0;
+	sector_t iblock;
+	uint32_t bno, nr;
+	int ret;
+
+	if (*pos >= sb->s_maxbytes)
+		return -EFBIG;
+	len = min_t(size_t, len, sb->s_maxbytes - *pos);
+	if (!len)
+		return 0;
+
+	/*
+	 * Un fichier inline qui le reste est écrit dans l'inode. Sinon,
+	 * ouichefs_map_alloc() déplace d'abord ses données dans un bloc.
+	 */
+	if (ouichefs_is_inline(inode) && *pos + len <= OUICHEFS_INLINE_SIZE) {
+		char inline_data[OUICHEFS_INLINE_SIZE];
+
+		if (copy_from_user(inline_data, data, len))
+			return -EFAULT;
+
+		down_write(&ci->map_sem);
+		if (ouichefs_is_inline(inode)) {
+			if (*pos > inode->i_size)
+				memset(ci->i_inline + inode->i_size, 0,
+				       *pos - inode->i_size);
+			memcpy(ci->i_inline + *pos, inline_data, len);
+			*pos += len;
+			if (*pos > inode->i_size)
+				inode->i_size = *pos;
+			mark_inode_dirty(inode);
+			up_write(&ci->map_sem);
+			return len;
+		}
+		up_write(&ci->map_sem);
+	}
+
+	/*
+	 * Allocate the missing blocks of the written range only, one
+	 * contiguous extent at a time. Blocks before the range that are not
+	 * allocated stay holes. The new blocks are flagged unwritten so that
+	 * the loop below zeroes them in memory instead of reading them.
+	 */
+	down_write(&ci->map_sem);
+	ret = ouichefs_map_alloc(inode, *pos / OUICHEFS_BLOCK_SIZE,
+				 (*pos + len - 1) / OUICHEFS_BLOCK_SIZE,
+				 OUICHEFS_UNWRITTEN);
+	up_write(&ci->map_sem);
+	if (ret)
+		return ret;
+
+	while (len > 0) {
+		iblock = *pos / OUICHEFS_BLOCK_SIZE;
+
+		/*
+		 * Lire ou initialiser le bloc de données. Un bloc neuf ou
+		 * préalloué par fallocate() n'est pas lu : il est mis à zéro
+		 * en mémoire puis marqué comme écrit dans l'index.
+		 */
+		down_read(&ci->map_sem);
+		ret = ouichefs_map_lookup(inode, iblock, 1, &bno, &nr);
+		up_read(&ci->map_sem);
+		if (ret)
+			return ret;
+		if (!bno)
+			return -EIO;
+		if (bno & OUICHEFS_UNWRITTEN) {
+			bno = ouichefs_index_bno(bno);
+			bh = sb_getblk(sb, bno);
+			if (bh) {
+				lock_buffer(bh);
+				memset(bh->b_data, 0, OUICHEFS_BLOCK_SIZE);
+				set_buffer_uptodate(bh);
+				unlock_buffer(bh);
+				down_write(&ci->map_sem);
+				ret = ouichefs_map_set(inode, iblock, bno, 1);
+				up_write(&ci->map_sem);
+				if (ret) {
+					brelse(bh);
+					return ret;
+				}
+			}
+		} else {
+			bh = sb_bread(sb, bno);
+		}
+		if (!bh)
+			return -EIO;
+		buffer = bh->b_data;
+
+		/* Calculer la quantité de données à écrire dans ce bloc */
+		to_be_written =
+			min(len, (size_t)(OUICHEFS_BLOCK_SIZE -
+					  (*pos % OUICHEFS_BLOCK_SIZE)));
+
+		/* Copier les données de l'utilisateur dans le bloc de données */
+		if (copy_from_user(buffer + (*pos % OUICHEFS_BLOCK_SIZE), data,
+				   to_be_written)) {
+			brelse(bh);
+			return -EFAULT;
+		}
+
+		mark_buffer_dirty(bh);
+		sync_dirty_buffer(bh);
+		brelse(bh);
+
+		*pos += to_be_written;
+		data += to_be_written;
+		len -= to_be_written;
+		written += to_be_written;
+
+		/* Mettre à jour la taille du fichier si nécessaire */
+		if (*pos > inode->i_size) {
+			inode->i_size = *pos;
+			mark_inode_dirty(inode);
+		}
+	}
+
+	return written;
+}
+
+/*
+ * Write function for the ouichefs filesystem. This function allows to write
+ * data without the use of page cache (see __ouichefs_write()), except for
+ * O_DIRECT. The dirty pages of the range are written first so that their
+ * writeback does not overwrite the new data later, and the pages of the range
+ * are dropped afterwards as they hold the old data.
+ */
+static ssize_t ouichefs_write(struct file *file, const char __user *data,
+			      size_t len, loff_t *pos)
+{
+	struct inode *inode = file->f_inode;
+	loff_t start;
+	ssize_t written;
+	int ret;
+
+	if (file->f_flags & O_RDONLY)
+		return -EBADF;
+
+	if (file->f_flags & O_DIRECT)
+		return ouichefs_iter_rw(file, (char __user *)data, len, pos,
+					true);
+
+	if (!len)
+		return 0;
+
+	inode_lock(inode);
+	if (file->f_flags & O_APPEND)
+		*pos = inode->i_size;
+	start = *pos;
+	ret = filemap_write_and_wait_range(inode->i_mapping, start,
+					   start + len - 1);
+	if (ret) {
+		inode_unlock(inode);
+		return ret;
+	}
+	written = __ouichefs_write(file, data, len, pos);
+	ret = invalidate_inode_pages2_range(inode->i_mapping,
+					    start >> PAGE_SHIFT,
+					    (start + len - 1) >> PAGE_SHIFT);
+	if (ret)
+		pr_warn("inode %lu: stale page cache after write\n",
+			inode->i_ino);
+	inode_unlock(inode);
+
+	return written;
+}
+
+/*
+ * ouichefs_insert_blocks_to_index() - Makes room for entries in the index
+ * block
+ *
+ * @index:	the index block to update
+ * @iblock:	the index of the block to insert after
+ * @nr:		the number of entries to insert
+ *
+ * Opens nr empty entries after iblock in the index block of a file, keeping
+ * all the following blocks. The new entries and the entry at iblock are left
+ * to the caller.
+ *
+ * Return: 0 on success, -EFBIG if the last nr entries of the index are not
+ * all free.
+ */
+static int
+ouichefs_insert_blocks_to_index(struct ouichefs_file_index_block *index,
+				sector_t iblock, uint32_t nr)
+{
+	uint32_t last = iblock + 1;
+
+	if (!nr || nr > OUICHEFS_PTRS - iblock - 1 ||
+	    index->blocks[OUICHEFS_PTRS - nr])
+		return -EFBIG;
+
+	/* Décaler d'un coup les blocs suivants, jusqu'à une entrée vide */
+	while (last < OUICHEFS_PTRS - nr && index->blocks[last])
+		last++;
+	memmove(&index->blocks[iblock + 1 + nr], &index->blocks[iblock + 1],
+		(last - iblock - 1) * sizeof(index->blocks[0]));
+	memset(&index->blocks[iblock + 1], 0, nr * sizeof(index->blocks[0]));
+
+	return 0;
+}
+
+/*
+ * ouichefs_insert_data() - insert data in the block of an insert mode file
+ * @inode:	the inode of the file
+ * @bh_index:	the buffer of the index block of the file
+ * @pos:	the position to insert the data at
+ * @data:	the data to insert, already copied from the user
+ * @len:	the size of data, at most a full block
+ * @rest:	the size of the rest of the write, data included
+ *
+ * Insert as much of data at pos as fits in the block holding pos, splitting
+ * the block if data is inserted before its end. A split also inserts the
+ * empty blocks the rest of the write needs, so that the next calls fill them
+ * instead of splitting again; all the new blocks come from a single
+ * allocation. On failure, the index still describes the same data (with
+ * maybe more blocks allocated, empty or full of zeroes). Called with
+ * ci->map_sem held for writing.
+ *
+ * Return: the number of bytes inserted, or a negative error code.
+ */
+static ssize_t ouichefs_insert_data(struct inode *inode,
+				    struct buffer_head *bh_index, loff_t pos,
+				    const char *data, size_t len, size_t rest)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_file_index_block *index;
+	struct buffer_head *bh, *bh_bis;
+	size_t to_be_written;
+	sector_t iblock, bisno;
+	uint32_t bno, first = 0, count, size_block, size_bis;
+	uint32_t need, extra, nr_free, i;
+	loff_t pos_in_block;
+	bool hole;
+	int ret;
+
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+	pos_in_block = ouichefs_find_block(inode, &pos, &iblock, index, 1);
+	if (iblock >= OUICHEFS_PTRS)
+		return -EFBIG;
+
+	/*
+	 * Écriture après le dernier bloc : allouer d'un coup tous les blocs
+	 * nécessaires au reste de l'écriture. Ils restent vides (taille 0)
+	 * jusqu'à ce que les appels suivants les remplissent.
+	 */
+	if (index->blocks[iblock] == 0) {
+		count = min_t(uint32_t,
+			      DIV_ROUND_UP(rest, OUICHEFS_BLOCK_SIZE - 1),
+			      OUICHEFS_PTRS - iblock);
+		ret = ouichefs_alloc_index_range(inode, index, iblock,
+						 iblock + count - 1);
+		mark_buffer_dirty_inode(bh_index, inode);
+		__ouichefs_index_cache_update(inode, index);
+		if (ret && index->blocks[iblock] == 0)
+			return ret;
+	}
+
+	bno = index->blocks[iblock] & 0x000FFFFF;
+	size_block = index->blocks[iblock] >> 20;
+	hole = !bno;
+
+	/*
+	 * cas 2 : insertion au milieu du bloc. Sa fin part dans une nouvelle
+	 * entrée, précédée de blocs vides (taille 0) pour le reste de
+	 * l'écriture qui ne tient pas dans le bloc, autant que l'index a
+	 * d'entrées libres.
+	 */
+	size_bis = pos_in_block < size_block ? size_block - pos_in_block : 0;
+	extra = 0;
+	if (size_bis) {
+		nr_free = 0;
+		while (nr_free < OUICHEFS_PTRS - iblock - 1 &&
+		       !index->blocks[OUICHEFS_PTRS - 1 - nr_free])
+			nr_free++;
+		if (!nr_free)
+			return -EFBIG;
+		if (rest > OUICHEFS_BLOCK_SIZE - 1 - pos_in_block)
+			extra = DIV_ROUND_UP(rest - (OUICHEFS_BLOCK_SIZE - 1 -
+						     pos_in_block),
+					     OUICHEFS_BLOCK_SIZE - 1);
+		extra = min(extra, nr_free - 1);
+	}
+
+	/*
+	 * Allouer d'un seul appel, dans l'ordre du fichier, le bloc d'un trou
+	 * (qui garde sa fin s'il faut le couper), les blocs vides et le bloc
+	 * recevant la fin d'un bloc coupé. Seul le premier est indispensable :
+	 * s'il en manque, moins de blocs vides sont insérés.
+	 */
+	need = hole || size_bis ? 1 : 0;
+	if (need + extra) {
+		first = get_free_file_blocks(inode,
+					     ouichefs_block_goal(ci, index,
+								 iblock),
+					     need + extra, &count);
+		if (!first)
+			return -ENOSPC;
+		extra = count - need;
+	}
+	if (hole)
+		bno = first;
+	bisno = size_bis && !hole ? first + extra : 0;
+
+	if (hole) {
+		bh = sb_getblk(sb, bno);
+		if (bh) {
+			lock_buffer(bh);
+			memset(bh->b_data, 0, OUICHEFS_BLOCK_SIZE);
+			set_buffer_uptodate(bh);
+			unlock_buffer(bh);
+		}
+	} else {
+		bh = sb_bread(sb, bno);
+	}
+	if (!bh) {
+		ret = -EIO;
+		goto free_blocks;
+	}
+
+	if (bisno) {
+		bh_bis = sb_getblk(sb, bisno);
+		if (!bh_bis) {
+			brelse(bh);
+			ret = -EIO;
+			goto free_blocks;
+		}
+		lock_buffer(bh_bis);
+		memcpy(bh_bis->b_data, bh->b_data + pos_in_block, size_bis);
+		memset(bh_bis->b_data + size_bis, 0,
+		       OUICHEFS_BLOCK_SIZE - size_bis);
+		set_buffer_uptodate(bh_bis);
+		unlock_buffer(bh_bis);
+		mark_buffer_dirty_inode(bh_bis, inode);
+		brelse(bh_bis);
+	}
 
-	if (size_block - pos_in_block < len)
-		to_be_copied = size_block - pos_in_block;
-	else
-		to_be_copied = len;
+	if (hole)
+		index->blocks[iblock] |= bno;
+	if (size_bis) {
+		/* Cannot fail, enough entries are free (checked above) */
+		ouichefs_insert_blocks_to_index(index, iblock, extra + 1);
+		for (i = 0; i < extra; i++)
+			index->blocks[iblock + 1 + i] = first + hole + i;
+		index->blocks[iblock + 1 + extra] = bisno + (size_bis << 20);
+		inode->i_blocks += extra + 1;
+		memset(bh->b_data + pos_in_block, 0, size_bis);
+		size_block = pos_in_block;
+	}
+	if (hole || size_bis) {
+		mark_buffer_dirty_inode(bh_index, inode);
+		__ouichefs_index_cache_update(inode, index);
+	}
 
-	copied_to_user =
-		to_be_copied - copy_to_user(data, buffer, to_be_copied);
+	/* cas 3 : ajout dans le bloc avec un trou entre sa fin et l'offset */
+	if (pos_in_block > size_block) {
+		memset(bh->b_data + size_block, 0, pos_in_block - size_block);
+		size_block = pos_in_block;
+	}
 
-	*pos += copied_to_user;
-	file->f_pos = *pos;
+	/* cas 1 : ajout à la fin du bloc */
+	to_be_written = min_t(size_t, len,
+			      OUICHEFS_BLOCK_SIZE - 1 - size_block);
+	memcpy(bh->b_data + pos_in_block, data, to_be_written);
+	index->blocks[iblock] = bno + ((pos_in_block + to_be_written) << 20);
 
+	mark_buffer_dirty_inode(bh, inode);
+	mark_buffer_dirty_inode(bh_index, inode);
+	__ouichefs_index_cache_update(inode, index);
 	brelse(bh);
-	brelse(bh_index);
 
-	return copied_to_user;
+	return to_be_written;
+
+free_blocks:
+	for (i = 0; i < need + extra; i++)
+		put_block(OUICHEFS_SB(sb), first + i);
+	return ret;
 }
 
 /*
- * Write function for the ouichefs filesystem. This function allows to write data without
- * the use of page cache.
+ * Write function for the ouichefs filesystem. This function inserts the data of
+ * from at *pos, without going through the page cache (see
+ * ouichefs_write_insert_iter()).
+ *
+ * In insert mode, blocks are numbered as follows in the index block:
+ *	- The 12 most significant bits represent the size of the block
+ *	- The 20 least significant bits represent the block number
+ *
+ * The data is copied from the user one block at a time before ci->map_sem is
+ * taken: a fault on a page of the file mapped in memory would take it again,
+ * and a failed copy must not leave the index half modified.
  */
-static ssize_t ouichefs_write(struct file *file, const char __user *data,
-			      size_t len, loff_t *pos)
+static ssize_t __ouichefs_write_insert(struct file *file,
+				       struct iov_iter *from, loff_t *pos)
 {
 	struct inode *inode = file->f_inode;
 	struct super_block *sb = inode->i_sb;
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct ouichefs_file_index_block *index;
-	struct buffer_head *bh_index, *bh;
-	char *buffer;
-	size_t to_be_written, written = 0;
-	sector_t iblock;
-	uint32_t bno;
-
-	if (file->f_flags & O_RDONLY)
-		return -EBADF;
-
-	if (file->f_flags & O_APPEND)
-		*pos = inode->i_size;
+	struct buffer_head *bh_index;
+	size_t len = iov_iter_count(from);
+	size_t chunk, written = 0;
+	sector_t iblock, i;
+	blkcnt_t nr_blocks;
+	ssize_t ret = 0;
+	char *data;
 
 	if (*pos >= OUICHEFS_MAX_FILESIZE)
 		return -EFBIG;
 
+	data = kmalloc(OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
+	if (!data)
+		return -ENOMEM;
 	bh_index = sb_bread(sb, ci->index_block);
+	if (!bh_index) {
+		ret = -EIO;
+		goto free_data;
+	}
 	index = (struct ouichefs_file_index_block *)bh_index->b_data;
-	iblock = *pos / OUICHEFS_BLOCK_SIZE;
-
-	if (!bh_index)
-		return -EIO;
-
-	/* Vérifier entre dernier bloc alloué et iblock si des blocs sont alloués, sinon les allouer */
-	for (uint32_t i = 0; i < iblock; i++) {
-		if (index->blocks[i] == 0) {
-			/* Allouer un nouveau bloc */
-			bno = get_free_block(OUICHEFS_SB(sb));
-			if (!bno) {
-				brelse(bh_index);
-				return -ENOSPC;
-			}
-			inode->i_blocks++;
-			index->blocks[i] = bno;
-			mark_buffer_dirty(bh_index);
-			sync_dirty_buffer(bh_index);
-		}
+
+	/*
+	 * Les entrées vides entre le dernier bloc et celui de pos deviennent
+	 * des trous : une taille pleine sans bloc alloué (numéro 0), ajoutée à
+	 * celle du fichier. Rien n'est alloué ni écrit sur le disque, mais
+	 * i_blocks compte les entrées (voir OUICHEFS_INSERT_HOLE).
+	 */
+	down_write(&ci->map_sem);
+	ouichefs_find_block(inode, pos, &iblock, index, 1);
+	nr_blocks = inode->i_blocks;
+	for (i = 0; i < min_t(sector_t, iblock, OUICHEFS_PTRS); i++) {
+		if (index->blocks[i])
+			continue;
+		index->blocks[i] = OUICHEFS_INSERT_HOLE;
+		inode->i_blocks++;
+	}
+	if (inode->i_blocks != nr_blocks) {
+		inode->i_size += (inode->i_blocks - nr_blocks) *
+				 (OUICHEFS_BLOCK_SIZE - 1);
+		mark_buffer_dirty_inode(bh_index, inode);
+		__ouichefs_index_cache_update(inode, index);
+		mark_inode_dirty(inode);
 	}
+	up_write(&ci->map_sem);
 
 	while (len > 0) {
-		iblock = *pos / OUICHEFS_BLOCK_SIZE;
-		/* Vérifier si le bloc est déjà alloué */
-		if (index->blocks[iblock] == 0) {
-			/* Allouer un nouveau bloc */
-			bno = get_free_block(OUICHEFS_SB(sb));
-			if (!bno) {
-				brelse(bh_index);
-				return -ENOSPC;
-			}
-			inode->i_blocks++;
-			index->blocks[iblock] = bno;
-			mark_buffer_dirty(bh_index);
-			sync_dirty_buffer(bh_index);
-		} else {
-			bno = index->blocks[iblock];
-		}
-
-		/* Lire ou initialiser le bloc de données */
-		bh = sb_bread(sb, bno);
-		if (!bh) {
-			brelse(bh_index);
-			return -EIO;
+		chunk = min_t(size_t, len, OUICHEFS_BLOCK_SIZE - 1);
+		if (copy_from_iter(data, chunk, from) != chunk) {
+			ret = -EFAULT;
+			break;
 		}
-		buffer = bh->b_data;
-
-		/* Calculer la quantité de données à écrire dans ce bloc */
-		to_be_written =
-			min(len, (size_t)(OUICHEFS_BLOCK_SIZE -
-					  (*pos % OUICHEFS_BLOCK_SIZE)));
 
-		/* Copier les données de l'utilisateur dans le bloc de données */
-		if (copy_from_user(buffer + (*pos % OUICHEFS_BLOCK_SIZE), data,
-				   to_be_written)) {
-			brelse(bh);
-			brelse(bh_index);
-			return -EFAULT;
+		down_write(&ci->map_sem);
+		ret = ouichefs_insert_data(inode, bh_index, *pos, data, chunk,
+					   len);
+		up_write(&ci->map_sem);
+		if (ret < 0) {
+			iov_iter_revert(from, chunk);
+			break;
 		}
+		/* Le reste du morceau va dans le bloc suivant */
+		iov_iter_revert(from, chunk - ret);
 
-		mark_buffer_dirty(bh);
-		sync_dirty_buffer(bh);
-		brelse(bh);
-
-		*pos += to_be_written;
-		data += to_be_written;
-		len -= to_be_written;
-		written += to_be_written;
-
-		/* Mettre à jour la taille du fichier si nécessaire */
-		if (*pos > inode->i_size) {
-			inode->i_size = *pos;
-			mark_inode_dirty(inode);
-		}
+		*pos += ret;
+		len -= ret;
+		written += ret;
 	}
 
+	inode->i_size = ouichefs_file_size(inode, index);
+	mark_inode_dirty(inode);
 	brelse(bh_index);
+free_data:
+	kfree(data);
 
-	return written;
+	return written ? written : ret;
 }
 
 /*
- * ouichefs_insert_block_to_index() - Inserts a block number into the index
- * block
- *
- * @index:	the index block to update
- * @iblock:	the index of the block to insert after
- * @new_block:	the block number to insert
- *
- * Inserts a block number into the index block of a file by adding it after
- * iblock and keeping all the following blocks.
+ * Insert the data of from at *pos in an insert mode file, with the inode lock
+ * held. The data following *pos moves: the page cache of the file is written
+ * back first (pages dirtied before the file got an index block), and dropped
+ * from *pos on afterwards, including the pages mapped by mmap().
  */
-static void
-ouichefs_insert_block_to_index(struct ouichefs_file_index_block *index,
-			       sector_t iblock, sector_t new_block)
+static ssize_t ouichefs_write_insert_iter(struct file *file,
+					  struct iov_iter *from, loff_t *pos)
 {
-	/* Décaler les blocs suivants */
-	uint32_t i = iblock + 1;
-	sector_t tmp = index->blocks[i];
+	struct inode *inode = file->f_inode;
+	ssize_t written;
+	pgoff_t start;
+	int ret;
 
-	index->blocks[i] = new_block;
-	while (index->blocks[i] != 0) {
-		i++;
-		sector_t tmp2 = index->blocks[i];
+	inode_lock(inode);
+	if (file->f_flags & O_APPEND)
+		*pos = inode->i_size;
+	ret = filemap_write_and_wait(inode->i_mapping);
+	if (ret) {
+		inode_unlock(inode);
+		return ret;
+	}
+	start = min_t(loff_t, *pos, inode->i_size) >> PAGE_SHIFT;
+	written = __ouichefs_write_insert(file, from, pos);
+	ret = invalidate_inode_pages2_range(inode->i_mapping, start, -1);
+	if (ret)
+		pr_warn("inode %lu: stale page cache after insert\n",
+			inode->i_ino);
+	inode_unlock(inode);
 
-		index->blocks[i] = tmp;
-		tmp = tmp2;
+	/*
+	 * Les blocs modifiés sont écrits par fsync() ou par le writeback du
+	 * périphérique, sauf pour les écritures synchrones.
+	 */
+	if (written > 0 && ((file->f_flags & O_DSYNC) || IS_SYNC(inode))) {
+		ret = vfs_fsync_range(file, *pos - written, *pos - 1,
+				      !(file->f_flags & __O_SYNC));
+		if (ret)
+			return ret;
 	}
-	index->blocks[i++] = tmp;
-	/* Insérer le nouveau bloc */
-	index->blocks[iblock] = new_block;
+
+	return written;
 }
 
 /*
- * Write function for the ouichefs filesystem. This function allows to write data without
- * the use of page cache. This write function is the one that inserts data.
- *
- * In insert mode, blocks are numbered as follows in the index block:
- *	- The 12 most significant bits represent the size of the block
- *	- The 20 least significant bits represent the block number
+ * Write function for the ouichefs filesystem, for write(): the data is
+ * inserted at *pos (see __ouichefs_write_insert()). Files that cannot be
+ * written in insert mode use ouichefs_write().
  */
 static ssize_t ouichefs_write_insert(struct file *file, const char __user *data,
 				     size_t len, loff_t *pos)
 {
 	struct inode *inode = file->f_inode;
-	struct super_block *sb = inode->i_sb;
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
-	struct ouichefs_file_index_block *index;
-	struct buffer_head *bh_index, *bh;
-	char *buffer;
-	size_t to_be_written, written = 0;
-	sector_t iblock;
-	uint32_t bno;
+	struct iov_iter iter;
+	int ret;
+
+	/* Les petits fichiers sans bloc d'index en reçoivent un */
+	if (!ci->index_block && !ouichefs_has_extents(inode)) {
+		/* Leurs pages du page cache sont d'abord écrites */
+		ret = filemap_write_and_wait(inode->i_mapping);
+		if (ret)
+			return ret;
+		down_write(&ci->map_sem);
+		ret = ouichefs_map_add_index(inode);
+		up_write(&ci->map_sem);
+		if (ret)
+			return ret;
+	}
+
+	/* Fichiers au format extents ou trop gros : pas de mode insertion */
+	if (!ouichefs_insert_capable(inode))
+		return ouichefs_write(file, data, len, pos);
 
 	if (file->f_flags & O_RDONLY)
 		return -EBADF;
 
-	if (file->f_flags & O_APPEND)
-		*pos = inode->i_size;
+	iov_iter_ubuf(&iter, ITER_SOURCE, (void __user *)data, len);
 
-	if (*pos >= OUICHEFS_MAX_FILESIZE)
+	return ouichefs_write_insert_iter(file, &iter, pos);
+}
+
+/*
+ * ouichefs_fallocate() - preallocate blocks for a file
+ * @file:	the file to preallocate blocks for
+ * @mode:	0 or FALLOC_FL_KEEP_SIZE
+ * @offset:	the start of the range to preallocate
+ * @len:	the length of the range to preallocate
+ *
+ * Allocate the missing blocks of the range, as contiguously as possible, and
+ * mark them unwritten in the index so that they read as zeroes without being
+ * zeroed on disk. Unless FALLOC_FL_KEEP_SIZE is set, the file is extended to
+ * the end of the range. The whole range is reserved first, so that the call
+ * fails early with -ENOSPC rather than leaving a partial preallocation.
+ * Insert mode entries have no room for the unwritten bit, so preallocation is
+ * only supported in normal mode or for files in the extent format.
+ *
+ * Return: 0 on success, a negative error code otherwise.
+ */
+static long ouichefs_fallocate(struct file *file, int mode, loff_t offset,
+			       loff_t len)
+{
+	struct inode *inode = file_inode(file);
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	loff_t end = offset + len;
+	sector_t first, last, iblock;
+	uint32_t missing = 0, entry, nr;
+	int ret;
+
+	if (mode & ~FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP;
+	if (ouichefs_insert_mode(inode))
+		return -EOPNOTSUPP;
+	if (end > inode->i_sb->s_maxbytes)
 		return -EFBIG;
 
-	bh_index = sb_bread(sb, ci->index_block);
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+	first = offset / OUICHEFS_BLOCK_SIZE;
+	last = (end - 1) / OUICHEFS_BLOCK_SIZE;
 
-	if (!bh_index)
-		return -EIO;
+	inode_lock(inode);
+	if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+		ret = inode_newsize_ok(inode, end);
+		if (ret)
+			goto unlock;
+	}
 
 	/*
-	 * Récuperer le bloc de donnees correspondant au pos
-	 * L'offset pos relative au bon bloc de donnée
+	 * Allocate the delayed blocks of the range first, they must not be
+	 * preallocated a second time
 	 */
-	loff_t pos_in_block =
-		ouichefs_find_block(inode, pos, &iblock, index, 1);
-
-	/* Vérifier entre dernier bloc alloué et iblock si des blocs sont alloués, sinon les allouer */
-	for (uint32_t i = 0; i < iblock; i++) {
-		if (index->blocks[i] == 0) {
-			/* Allouer un nouveau bloc */
-			bno = get_free_block(OUICHEFS_SB(sb));
-			if (!bno) {
-				brelse(bh_index);
-				return -ENOSPC;
-			}
-			/*
-			 * modification de la taille du bloc
-			 * ajout de cette taille dans le fichier
-			 * bloc composé de 0
-			 */
-			bno += (0xFFF00000);
-			inode->i_size += (OUICHEFS_BLOCK_SIZE - 1);
-			inode->i_blocks++;
-			index->blocks[i] = bno;
-			mark_buffer_dirty(bh_index);
-			sync_dirty_buffer(bh_index);
-		}
+	ret = filemap_write_and_wait_range(inode->i_mapping, offset, end - 1);
+	if (ret)
+		goto unlock;
+
+	down_write(&ci->map_sem);
+	for (iblock = first; iblock <= last; iblock += nr) {
+		ret = ouichefs_map_lookup(inode, iblock, last - iblock + 1,
+					  &entry, &nr);
+		if (ret)
+			goto unlock_map;
+		if (!entry)
+			missing += nr;
+	}
+	if (missing) {
+		ret = ouichefs_reserve_blocks(sbi, missing);
+		if (ret)
+			goto unlock_map;
+
+		ret = ouichefs_map_alloc(inode, first, last,
+					 OUICHEFS_UNWRITTEN);
+		ouichefs_release_blocks(sbi, missing);
+		if (ret)
+			goto unlock_map;
 	}
 
-	while (len > 0) {
-		pos_in_block =
-			ouichefs_find_block(inode, pos, &iblock, index, 1);
-
-		/* Vérifier si le bloc n'est pas déjà alloué */
-		if (index->blocks[iblock] == 0) {
-			/* Allouer un nouveau bloc */
-			bno = get_free_block(OUICHEFS_SB(sb));
-			if (!bno) {
-				brelse(bh_index);
-				return -ENOSPC;
-			}
-			inode->i_blocks++;
-			index->blocks[iblock] = bno;
-			mark_buffer_dirty(bh_index);
-			sync_dirty_buffer(bh_index);
-		} else {
-			bno = index->blocks[iblock];
-		}
-
-		/* Lire ou initialiser le bloc de données */
-		bno = (index->blocks[iblock] & 0x000FFFFF);
-		uint32_t size_block = (index->blocks[iblock] >> 20);
-
-		bh = sb_bread(sb, bno);
-		if (!bh) {
-			brelse(bh_index);
-			return -EIO;
-		}
-		buffer = bh->b_data;
-
-		/* cas 2 : insertion de données dans un bloc à un offset où des données sont présentes */
-		if (pos_in_block < size_block) {
-			/* allouer un nouveau bloc */
-			sector_t bisno = get_free_block(OUICHEFS_SB(sb));
-
-			if (!bisno) {
-				brelse(bh_index);
-				return -ENOSPC;
-			}
-			inode->i_blocks++;
-			mark_buffer_dirty(bh_index);
-			sync_dirty_buffer(bh_index);
-
-			struct buffer_head *bh_bis = sb_bread(sb, bisno);
-
-			if (!bh_bis) {
-				brelse(bh_index);
-				return -EIO;
-			}
-
-			uint32_t size_bis = (size_block - pos_in_block);
-
-			bisno += (size_bis << 20);
-
-			memcpy(bh_bis->b_data, (buffer + pos_in_block),
-			       size_bis);
-
-			mark_buffer_dirty(bh_bis);
-			sync_dirty_buffer(bh_bis);
-			brelse(bh_bis);
-
-			memset(buffer + pos_in_block, 0, size_bis);
-			ouichefs_insert_block_to_index(index, iblock, bisno);
-			size_block = pos_in_block;
-		}
-
-		/* cas 3 ajout dans le bloc avec un gap entre size_block et l'offset */
-		if (pos_in_block > size_block && pos_in_block) {
-			memset(buffer + size_block, 0,
-			       pos_in_block - size_block);
-			size_block = pos_in_block;
-
-			inode->i_size += pos_in_block - size_block;
-			mark_inode_dirty(inode);
-		}
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > inode->i_size)
+		i_size_write(inode, end);
+	inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
 
-		/* cas 1 : write append */
-		/* Calculer la quantité de données à écrire dans ce bloc */
-		to_be_written = min(
-			len, (size_t)(OUICHEFS_BLOCK_SIZE - 1 - size_block));
+unlock_map:
+	up_write(&ci->map_sem);
+unlock:
+	inode_unlock(inode);
 
-		/* Copier les données de l'utilisateur dans le bloc de données */
-		if (copy_from_user(buffer + (pos_in_block), data,
-				   to_be_written)) {
-			brelse(bh);
-			brelse(bh_index);
-			return -EFAULT;
-		}
-		uint32_t size = (pos_in_block + to_be_written) << 20;
+	return ret;
+}
 
-		bno += size;
-		index->blocks[iblock] = bno;
+/*
+ * __ouichefs_get_frag() - get stats about internal fragmentation
+ * @inode: the inode of the file
+ * @index: the index block of the file
+ * @part_filled_blocks: the pointer to the number of partially filled blocks
+ * @intern_frag_waste: the pointer to the number of bytes wasted
+ *
+ * Same as ouichefs_get_frag(), from an index block already read by the
+ * caller, with ci->map_sem held.
+ */
+static void __ouichefs_get_frag(struct inode *inode,
+				struct ouichefs_file_index_block *index,
+				uint32_t *part_filled_blocks,
+				uint32_t *intern_frag_waste)
+{
+	*intern_frag_waste = 0;
 
-		mark_buffer_dirty(bh);
-		sync_dirty_buffer(bh);
-		mark_buffer_dirty(bh_index);
-		sync_dirty_buffer(bh_index);
-		brelse(bh);
+	for (uint32_t i = 0; i < inode->i_blocks - 1; i++) {
+		/* La taille du bloc correspond aux 12 premiers bits de l'entrée */
+		uint32_t block_size = (index->blocks[i] >> 20);
 
-		*pos += to_be_written;
-		data += to_be_written;
-		len -= to_be_written;
-		written += to_be_written;
+		/* Les trous n'occupent pas de bloc, donc ne gaspillent rien */
+		if (!(index->blocks[i] & 0x000FFFFF))
+			continue;
 
-		/* Mettre à jour la taille du fichier si nécessaire */
-		if (*pos > inode->i_size) {
-			inode->i_size = *pos;
-			mark_inode_dirty(inode);
+		if (block_size < (OUICHEFS_BLOCK_SIZE - 1)) {
+			*intern_frag_waste +=
+				OUICHEFS_BLOCK_SIZE - 1 - block_size;
+			*part_filled_blocks += 1;
 		}
 	}
-
-	brelse(bh_index);
-	inode->i_size = ouichefs_file_size(inode, index);
-	mark_inode_dirty(inode);
-
-	return written;
 }
 
 /*
  * ouichefs_get_frag() - get stats about internal fragmentation
- * @index: the index block of the file
+ * @inode: the inode of the file
  * @part_filled_blocks: the pointer to the number of partially filled blocks
  * @intern_frag_waste: the pointer to the number of bytes wasted
  *
@@ -770,31 +2175,24 @@ static ssize_t ouichefs_write_insert(struct file *file, const char __user *data,
 static void ouichefs_get_frag(struct inode *inode, uint32_t *part_filled_blocks,
 			      uint32_t *intern_frag_waste)
 {
-	struct super_block *sb = inode->i_sb;
 	struct ouichefs_file_index_block *index;
 	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
 	struct buffer_head *bh_index;
 	*intern_frag_waste = 0;
 
-	bh_index = sb_bread(sb, ci->index_block);
+	down_read(&ci->map_sem);
+	index = ouichefs_index_cache_get(inode, &bh_index);
 
-	if (!bh_index)
+	if (!index) {
+		up_read(&ci->map_sem);
 		return;
-
-	index = (struct ouichefs_file_index_block *)bh_index->b_data;
-
-	for (uint32_t i = 0; i < inode->i_blocks - 1; i++) {
-		/* La taille du bloc correspond aux 12 premiers bits du numéro de bloc */
-		uint32_t block_size = (index->blocks[i] >> 20);
-
-		if (block_size < (OUICHEFS_BLOCK_SIZE - 1)) {
-			*intern_frag_waste +=
-				OUICHEFS_BLOCK_SIZE - 1 - block_size;
-			*part_filled_blocks += 1;
-		}
 	}
 
+	__ouichefs_get_frag(inode, index, part_filled_blocks,
+			    intern_frag_waste);
+
 	brelse(bh_index);
+	up_read(&ci->map_sem);
 }
 
 /*
@@ -802,9 +2200,11 @@ static void ouichefs_get_frag(struct inode *inode, uint32_t *part_filled_blocks,
  * @inode: the inode of the file to defragment
  *
  * This function defragments a file by moving data from a block that follows
- * a partially filled block to the current partially filled block.
+ * a partially filled block to the current partially filled block. The inode
+ * lock keeps writes out, the dirty pages of the file are written first, and
+ * ci->map_sem is held for writing while the blocks and the index change.
  *
- * Return: 0 on success, -EIO on error
+ * Return: 0 on success, a negative error code on error
  */
 static long ouichefs_defrag(struct inode *inode)
 {
@@ -814,18 +2214,25 @@ static long ouichefs_defrag(struct inode *inode)
 	struct ouichefs_file_index_block *index;
 	uint32_t part_filled_blocks = 0;
 	uint32_t intern_frag_waste = 0;
-
-	ouichefs_get_frag(inode, &part_filled_blocks, &intern_frag_waste);
 	uint32_t frag_last_block = 0;
+	long ret;
 
+	inode_lock(inode);
+	ret = filemap_write_and_wait(inode->i_mapping);
+	if (ret)
+		goto unlock;
+
+	down_write(&ci->map_sem);
 	bh_index = sb_bread(sb, ci->index_block);
+	if (!bh_index) {
+		ret = -EIO;
+		goto unlock_map;
+	}
+	index = (struct ouichefs_file_index_block *)bh_index->b_data;
+	__ouichefs_get_frag(inode, index, &part_filled_blocks,
+			    &intern_frag_waste);
 
 	while (intern_frag_waste - frag_last_block) {
-		if (!bh_index)
-			return -EIO;
-
-		index = (struct ouichefs_file_index_block *)bh_index->b_data;
-
 		/*
 		 * Pour chaque bloc fragmenté qui n'est pas le dernier,
 		 * on "rapatrie" les données du bloc suivant dans le bloc
@@ -840,7 +2247,8 @@ static long ouichefs_defrag(struct inode *inode)
 			uint32_t block_size = (index->blocks[i] >> 20);
 			uint32_t block_number = (index->blocks[i] & 0x000FFFFF);
 
-			if (block_size == (OUICHEFS_BLOCK_SIZE - 1))
+			if (block_size == (OUICHEFS_BLOCK_SIZE - 1) ||
+			    block_number == 0)
 				continue;
 
 			uint32_t to_be_filled =
@@ -848,8 +2256,9 @@ static long ouichefs_defrag(struct inode *inode)
 
 			/* On ne défragmente pas le dernier bloc : absurdité */
 			if (i == inode->i_blocks - 1) {
-				ouichefs_get_frag(inode, &part_filled_blocks,
-						  &intern_frag_waste);
+				__ouichefs_get_frag(inode, index,
+						    &part_filled_blocks,
+						    &intern_frag_waste);
 				frag_last_block = to_be_filled;
 				break;
 			}
@@ -861,23 +2270,39 @@ static long ouichefs_defrag(struct inode *inode)
 			uint32_t to_be_moved =
 				min(to_be_filled, next_block_size);
 
-			/* Lecture des blocs courant et suivant */
+			/*
+			 * Lecture des blocs courant et suivant. Si le suivant
+			 * est un trou, on comble le bloc courant avec des zéros.
+			 */
 			struct buffer_head *bh = sb_bread(sb, block_number);
 			struct buffer_head *bh_next =
-				sb_bread(sb, next_block_number);
-
-			if (!bh || !bh_next)
-				return -EIO;
+				next_block_number ?
+					sb_bread(sb, next_block_number) :
+					NULL;
+
+			if (!bh || (next_block_number && !bh_next)) {
+				brelse(bh);
+				brelse(bh_next);
+				ret = -EIO;
+				goto out;
+			}
 
 			char *buffer = bh->b_data;
-			char *buffer_next = bh_next->b_data;
 
 			/* Déplacement des données */
-			memcpy(buffer + block_size, buffer_next, to_be_moved);
-			memmove(buffer_next, buffer_next + to_be_moved,
-				next_block_size - to_be_moved);
-			memset(buffer_next + next_block_size - to_be_moved, 0,
-			       to_be_moved);
+			if (bh_next) {
+				char *buffer_next = bh_next->b_data;
+
+				memcpy(buffer + block_size, buffer_next,
+				       to_be_moved);
+				memmove(buffer_next, buffer_next + to_be_moved,
+					next_block_size - to_be_moved);
+				memset(buffer_next + next_block_size -
+					       to_be_moved,
+				       0, to_be_moved);
+			} else {
+				memset(buffer + block_size, 0, to_be_moved);
+			}
 
 			/* Mise à jour des tailles des blocs */
 			block_size = block_size + to_be_moved;
@@ -889,10 +2314,11 @@ static long ouichefs_defrag(struct inode *inode)
 				(next_block_size << 20) + next_block_number;
 
 			mark_buffer_dirty(bh);
-			mark_buffer_dirty(bh_next);
-
 			sync_dirty_buffer(bh);
-			sync_dirty_buffer(bh_next);
+			if (bh_next) {
+				mark_buffer_dirty(bh_next);
+				sync_dirty_buffer(bh_next);
+			}
 
 			/* Décalage des blocs suivants d'un cran vers l'arrière dans l'index */
 			if (next_block_size == 0) {
@@ -900,7 +2326,9 @@ static long ouichefs_defrag(struct inode *inode)
 				     j++) {
 					index->blocks[j] = index->blocks[j + 1];
 				}
-				put_block(OUICHEFS_SB(sb), next_block_number);
+				if (next_block_number)
+					put_block(OUICHEFS_SB(sb),
+						  next_block_number);
 				inode->i_blocks--;
 			}
 
@@ -909,16 +2337,67 @@ static long ouichefs_defrag(struct inode *inode)
 		}
 
 		mark_buffer_dirty(bh_index);
+		__ouichefs_index_cache_update(inode, index);
 
-		ouichefs_get_frag(inode, &part_filled_blocks,
-				  &intern_frag_waste);
+		__ouichefs_get_frag(inode, index, &part_filled_blocks,
+				    &intern_frag_waste);
 	}
 
 	/* Put back the "block" zero at the end of the index */
 	index->blocks[inode->i_blocks] = 0;
 	inode->i_blocks++;
 
+out:
+	mark_buffer_dirty(bh_index);
+	__ouichefs_index_cache_update(inode, index);
+	brelse(bh_index);
+unlock_map:
+	up_write(&ci->map_sem);
+unlock:
+	inode_unlock(inode);
+
+	return ret;
+}
+
+/*
+ * INFO for an extent-indexed file: there is no per-block used size, so list
+ * the extents instead.
+ */
+static int ouichefs_extent_info(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_extent_block *eb;
+	struct buffer_head *bh_index;
+	uint32_t i;
+
+	pr_info("Blocks used by the file: %llu blocks\n", inode->i_blocks);
+
+	down_read(&ci->map_sem);
+	if (ci->index_block) {
+		eb = ouichefs_index_cache_get(inode, &bh_index);
+		if (!eb) {
+			up_read(&ci->map_sem);
+			return -EIO;
+		}
+	} else {
+		/* Extents stored in the inode */
+		bh_index = NULL;
+		eb = (struct ouichefs_extent_block *)ci->i_direct;
+	}
+	pr_info("Extents: %u%s\n", eb->nr_extents,
+		ci->index_block ? "" : " (in the inode)");
+	for (i = 0; i < eb->nr_extents; i++) {
+		struct ouichefs_extent *ext = &eb->extents[i];
+
+		pr_info("Extent %u: file block %u -> block %u, %u blocks%s\n",
+			i, ext->ee_block, ouichefs_index_bno(ext->ee_start),
+			ext->ee_len,
+			(ext->ee_start & OUICHEFS_UNWRITTEN) ? " (unwritten)" :
+							       "");
+	}
+
 	brelse(bh_index);
+	up_read(&ci->map_sem);
 	return 0;
 }
 
@@ -933,6 +2412,7 @@ static long ouichefs_defrag(struct inode *inode)
  * - SWITCH_MODE:	switch the read/write mode from normal to insert
  *			and vice versa
  * - DISPLAY_MODE:	diplay the current read/write mode
+ * - STATS:		return statistics about the file system of the file
  */
 static long ouichefs_unlocked_ioctl(struct file *f, uint32_t cmd,
 				    unsigned long arg)
@@ -946,6 +2426,11 @@ static long ouichefs_unlocked_ioctl(struct file *f, uint32_t cmd,
 		(struct file_operations *)f->f_inode->i_fop;
 	uint32_t part_filled_blocks = 0;
 	uint32_t intern_frag_waste = 0;
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_stats stats;
+	struct ouichefs_group *grp;
+	bool fext = false;
+	uint32_t g;
 
 	if (!inode)
 		return -ENOTTY;
@@ -953,6 +2438,19 @@ static long ouichefs_unlocked_ioctl(struct file *f, uint32_t cmd,
 	switch (cmd) {
 	case INFO:
 		/* INFO : displays info about the file as described above */
+		if (ouichefs_is_inline(inode)) {
+			pr_info("Data stored in the inode: %lld bytes\n",
+				inode->i_size);
+			return 0;
+		}
+		if (ouichefs_has_extents(inode))
+			return ouichefs_extent_info(inode);
+		if (!ouichefs_insert_capable(inode)) {
+			pr_info("Blocks used by the file: %llu blocks\n",
+				inode->i_blocks);
+			return 0;
+		}
+
 		ouichefs_get_frag(inode, &part_filled_blocks,
 				  &intern_frag_waste);
 		pr_info("Blocks used by the file: %llu blocks\n",
@@ -963,12 +2461,13 @@ static long ouichefs_unlocked_ioctl(struct file *f, uint32_t cmd,
 			intern_frag_waste);
 
 		/* List of blocks with their effective size */
-		bh_index = sb_bread(sb, ci->index_block);
+		down_read(&ci->map_sem);
+		index = ouichefs_index_cache_get(inode, &bh_index);
 
-		if (!bh_index)
+		if (!index) {
+			up_read(&ci->map_sem);
 			return -EIO;
-
-		index = (struct ouichefs_file_index_block *)bh_index->b_data;
+		}
 
 		for (uint32_t i = 0; i < inode->i_blocks - 1; i++) {
 			// La taille du bloc correspond aux 12 premiers bits du numéro de bloc
@@ -980,10 +2479,14 @@ static long ouichefs_unlocked_ioctl(struct file *f, uint32_t cmd,
 		}
 
 		brelse(bh_index);
+		up_read(&ci->map_sem);
 
 		return 0;
 	case DEFRAG:
 		/* DEFRAG : defragment the file */
+		if (!ouichefs_insert_capable(inode))
+			return -EOPNOTSUPP;
+
 		return ouichefs_defrag(inode);
 	case SWITCH_MODE:
 		/* SWITCH_MODE : switch the read/write mode from normal to insert and vice versa */
@@ -1018,6 +2521,39 @@ static long ouichefs_unlocked_ioctl(struct file *f, uint32_t cmd,
 			return -EFAULT;
 		}
 
+		return 0;
+	case STATS:
+		/* STATS : statistics about the block allocator */
+		memset(&stats, 0, sizeof(stats));
+		stats.nr_free_blocks =
+			percpu_counter_sum_positive(&sbi->nr_free_blocks);
+		stats.nr_prealloc_hits =
+			percpu_counter_sum_positive(&sbi->prealloc_hits);
+		stats.nr_prealloc_misses =
+			percpu_counter_sum_positive(&sbi->prealloc_misses);
+		stats.nr_ra_hits = percpu_counter_sum_positive(&sbi->ra_hits);
+		stats.nr_ra_misses =
+			percpu_counter_sum_positive(&sbi->ra_misses);
+		for (g = 0; g < sbi->nr_groups; g++) {
+			grp = &sbi->groups[g];
+			spin_lock(&grp->balloc_lock);
+			if (grp->fext.valid) {
+				fext = true;
+				stats.nr_free_extents += grp->fext.nr_extents;
+				stats.largest_free_extent =
+					max(stats.largest_free_extent,
+					    ouichefs_fext_largest(grp));
+			}
+			spin_unlock(&grp->balloc_lock);
+		}
+		/* The per-CPU batches hold free extents too */
+		if (fext)
+			stats.nr_free_extents += ouichefs_balloc_batched(
+				sbi, &stats.largest_free_extent);
+
+		if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+			return -EFAULT;
+
 		return 0;
 	default:
 		/* default : unknown command */
@@ -1029,10 +2565,16 @@ static long ouichefs_unlocked_ioctl(struct file *f, uint32_t cmd,
 struct file_operations ouichefs_file_ops = {
 	.owner = THIS_MODULE,
 	.open = ouichefs_open,
+	.release = ouichefs_release,
 	.llseek = generic_file_llseek,
-	.read_iter = generic_file_read_iter,
-	.write_iter = generic_file_write_iter,
+	.read_iter = ouichefs_file_read_iter,
+	.write_iter = ouichefs_file_write_iter,
+	.splice_read = filemap_splice_read,
+	.splice_write = iter_file_splice_write,
+	.mmap = ouichefs_file_mmap,
 	.read = ouichefs_read_insert,
 	.write = ouichefs_write_insert,
+	.fallocate = ouichefs_fallocate,
+	.fsync = generic_file_fsync,
 	.unlocked_ioctl = ouichefs_unlocked_ioctl
 };
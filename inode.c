@@ -27,13 +27,13 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 	struct ouichefs_inode_info *ci = NULL;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct buffer_head *bh = NULL;
-	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK) + 1;
-	uint32_t inode_shift = ino % OUICHEFS_INODES_PER_BLOCK;
+	uint32_t inode_block, inode_offset, i;
 	int ret;
 
 	/* Fail if ino is out of range */
 	if (ino >= sbi->nr_inodes)
 		return ERR_PTR(-EINVAL);
+	inode_block = ouichefs_inode_block(sbi, ino, &inode_offset);
 
 	/* Get a locked inode from Linux */
 	inode = iget_locked(sb, ino);
@@ -50,8 +50,7 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 		ret = -EIO;
 		goto failed;
 	}
-	cinode = (struct ouichefs_inode *)bh->b_data;
-	cinode += inode_shift;
+	cinode = (struct ouichefs_inode *)(bh->b_data + inode_offset);
 
 	inode->i_ino = ino;
 	inode->i_sb = sb;
@@ -60,7 +59,8 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 	inode->i_mode = le32_to_cpu(cinode->i_mode);
 	i_uid_write(inode, le32_to_cpu(cinode->i_uid));
 	i_gid_write(inode, le32_to_cpu(cinode->i_gid));
-	inode->i_size = le32_to_cpu(cinode->i_size);
+	inode->i_size = le32_to_cpu(cinode->i_size) |
+			(loff_t)le32_to_cpu(cinode->i_size_high) << 32;
 	inode->i_ctime.tv_sec = (time64_t)le32_to_cpu(cinode->i_ctime);
 	inode->i_ctime.tv_nsec = (long)le64_to_cpu(cinode->i_nctime);
 	inode->i_atime.tv_sec = (time64_t)le32_to_cpu(cinode->i_atime);
@@ -71,12 +71,27 @@ struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino)
 	set_nlink(inode, le32_to_cpu(cinode->i_nlink));
 
 	ci->index_block = le32_to_cpu(cinode->index_block);
+	ci->dind_block = le32_to_cpu(cinode->i_dind_block);
+	ci->tind_block = le32_to_cpu(cinode->i_tind_block);
+	ci->i_flags = le32_to_cpu(cinode->i_flags);
+	/* Small inodes end before i_direct */
+	memset(ci->i_inline, 0, sizeof(ci->i_inline));
+	if (!(sbi->features & OUICHEFS_FEATURE_LARGE_INODES)) {
+		ci->i_flags &= ~OUICHEFS_INODE_INLINE;
+	} else if (ci->i_flags & OUICHEFS_INODE_INLINE) {
+		memcpy(ci->i_inline, cinode->i_inline, sizeof(ci->i_inline));
+	} else {
+		for (i = 0; i < OUICHEFS_NR_DIRECT; i++)
+			ci->i_direct[i] = le32_to_cpu(cinode->i_direct[i]);
+	}
 
 	if (S_ISDIR(inode->i_mode)) {
 		inode->i_fop = &ouichefs_dir_ops;
 	} else if (S_ISREG(inode->i_mode)) {
 		inode->i_fop = &ouichefs_file_ops;
 		inode->i_mapping->a_ops = &ouichefs_aops;
+		/* iomap handles folios larger than a block */
+		mapping_set_large_folios(inode->i_mapping);
 	}
 
 	brelse(bh);
@@ -150,7 +165,7 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 	struct ouichefs_inode_info *ci;
 	struct super_block *sb;
 	struct ouichefs_sb_info *sbi;
-	uint32_t ino, bno;
+	uint32_t ino, bno, goal;
 	int ret;
 
 	/* Check mode before doing anything to avoid undoing everything */
@@ -162,11 +177,12 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 	/* Check if inodes are available */
 	sb = dir->i_sb;
 	sbi = OUICHEFS_SB(sb);
-	if (sbi->nr_free_inodes == 0 || sbi->nr_free_blocks == 0)
+	if (percpu_counter_read_positive(&sbi->nr_free_inodes) == 0 ||
+	    ouichefs_avail_blocks(sbi) == 0)
 		return ERR_PTR(-ENOSPC);
 
 	/* Get a new free inode */
-	ino = get_free_inode(sbi);
+	ino = get_free_inode(sbi, dir->i_ino, S_ISDIR(mode));
 	if (!ino)
 		return ERR_PTR(-ENOSPC);
 	inode = ouichefs_iget(sb, ino);
@@ -176,17 +192,39 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 	}
 	ci = OUICHEFS_INODE(inode);
 
-	/* Get a free block for this new inode's index */
-	bno = get_free_block(sbi);
-	if (!bno) {
-		ret = -ENOSPC;
-		goto put_inode;
+	/*
+	 * Get a free block for this new inode's index, close to the index block
+	 * of its parent directory if they are in the same group, at the start
+	 * of the group of the new inode otherwise. With large inodes, regular
+	 * files start with their data in the inode instead.
+	 */
+	if (S_ISREG(mode) && (sbi->features & OUICHEFS_FEATURE_LARGE_INODES)) {
+		ci->index_block = 0;
+		inode->i_blocks = 0;
+	} else {
+		goal = OUICHEFS_INODE(dir)->index_block;
+		if (ouichefs_block_group(sbi, goal) !=
+		    ouichefs_ino_group(sbi, ino))
+			goal = ouichefs_ino_group(sbi, ino)->first_block;
+		bno = get_free_block(sbi, goal);
+		if (!bno) {
+			ret = -ENOSPC;
+			goto put_inode;
+		}
+		ci->index_block = bno;
+		inode->i_blocks = 1;
 	}
-	ci->index_block = bno;
+	memset(ci->i_inline, 0, sizeof(ci->i_inline));
 
 	/* Initialize inode */
 	inode_init_owner(&nop_mnt_idmap, inode, dir, mode);
-	inode->i_blocks = 1;
+	ci->dind_block = 0;
+	ci->tind_block = 0;
+	ci->i_flags = 0;
+	if (S_ISREG(mode) && (sbi->features & OUICHEFS_FEATURE_EXTENTS))
+		ci->i_flags |= OUICHEFS_INODE_EXTENTS;
+	if (S_ISREG(mode) && !ci->index_block)
+		ci->i_flags |= OUICHEFS_INODE_INLINE;
 	if (S_ISDIR(mode)) {
 		inode->i_size = OUICHEFS_BLOCK_SIZE;
 		inode->i_fop = &ouichefs_dir_ops;
@@ -195,6 +233,7 @@ static struct inode *ouichefs_new_inode(struct inode *dir, mode_t mode)
 		inode->i_size = 0;
 		inode->i_fop = &ouichefs_file_ops;
 		inode->i_mapping->a_ops = &ouichefs_aops;
+		mapping_set_large_folios(inode->i_mapping);
 		set_nlink(inode, 1);
 	}
 
@@ -257,15 +296,17 @@ static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
 	 * Scrub index_block for new file/directory to avoid previous data
 	 * messing with new file/directory.
 	 */
-	bh2 = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
-	if (!bh2) {
-		ret = -EIO;
-		goto iput;
+	if (OUICHEFS_INODE(inode)->index_block) {
+		bh2 = sb_bread(sb, OUICHEFS_INODE(inode)->index_block);
+		if (!bh2) {
+			ret = -EIO;
+			goto iput;
+		}
+		fblock = (char *)bh2->b_data;
+		memset(fblock, 0, OUICHEFS_BLOCK_SIZE);
+		mark_buffer_dirty(bh2);
+		brelse(bh2);
 	}
-	fblock = (char *)bh2->b_data;
-	memset(fblock, 0, OUICHEFS_BLOCK_SIZE);
-	mark_buffer_dirty(bh2);
-	brelse(bh2);
 
 	/* Find first free slot in parent index and register new inode */
 	for (i = 0; i < OUICHEFS_MAX_SUBFILES; i++)
@@ -290,7 +331,8 @@ static int ouichefs_create(struct mnt_idmap *idmap, struct inode *dir,
 	return 0;
 
 iput:
-	put_block(OUICHEFS_SB(sb), OUICHEFS_INODE(inode)->index_block);
+	if (OUICHEFS_INODE(inode)->index_block)
+		put_block(OUICHEFS_SB(sb), OUICHEFS_INODE(inode)->index_block);
 	put_inode(OUICHEFS_SB(sb), inode->i_ino);
 	iput(inode);
 end:
@@ -310,9 +352,8 @@ static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 	struct super_block *sb = dir->i_sb;
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct inode *inode = d_inode(dentry);
-	struct buffer_head *bh = NULL, *bh2 = NULL;
+	struct buffer_head *bh = NULL;
 	struct ouichefs_dir_block *dir_block = NULL;
-	struct ouichefs_file_index_block *file_block = NULL;
 	uint32_t ino, bno;
 	int i, f_id = -1, nr_subs = 0;
 
@@ -354,38 +395,36 @@ static int ouichefs_unlink(struct inode *dir, struct dentry *dentry)
 	 * forever. If we fail to scrub a data block, don't fail (too late
 	 * anyway), just put the block and continue.
 	 */
+	/* Drop the page cache first, it may hold delayed blocks */
+	truncate_inode_pages(inode->i_mapping, 0);
+	if (S_ISREG(inode->i_mode)) {
+		down_write(&OUICHEFS_INODE(inode)->map_sem);
+		ouichefs_map_truncate(inode, true);
+		up_write(&OUICHEFS_INODE(inode)->map_sem);
+	}
+	/* A file may have got an index block since bno was read */
+	bno = OUICHEFS_INODE(inode)->index_block;
+	if (!bno)
+		goto clean_inode;
 	bh = sb_bread(sb, bno);
 	if (!bh)
 		goto clean_inode;
-	file_block = (struct ouichefs_file_index_block *)bh->b_data;
-	if (S_ISDIR(inode->i_mode))
-		goto scrub;
-	for (i = 0; i < inode->i_blocks - 1; i++) {
-		char *block;
-
-		if (!file_block->blocks[i])
-			continue;
-
-		put_block(sbi, file_block->blocks[i]);
-		bh2 = sb_bread(sb, file_block->blocks[i]);
-		if (!bh2)
-			continue;
-		block = (char *)bh2->b_data;
-		memset(block, 0, OUICHEFS_BLOCK_SIZE);
-		mark_buffer_dirty(bh2);
-		brelse(bh2);
-	}
 
-scrub:
 	/* Scrub index block */
-	memset(file_block, 0, OUICHEFS_BLOCK_SIZE);
+	memset(bh->b_data, 0, OUICHEFS_BLOCK_SIZE);
 	mark_buffer_dirty(bh);
 	brelse(bh);
 
 clean_inode:
 	/* Cleanup inode and mark dirty */
+	if (S_ISREG(inode->i_mode)) {
+		down_write(&OUICHEFS_INODE(inode)->map_sem);
+		ouichefs_index_cache_drop(inode);
+		up_write(&OUICHEFS_INODE(inode)->map_sem);
+	}
 	inode->i_blocks = 0;
 	OUICHEFS_INODE(inode)->index_block = 0;
+	OUICHEFS_INODE(inode)->i_flags = 0;
 	inode->i_size = 0;
 	i_uid_write(inode, 0);
 	i_gid_write(inode, 0);
@@ -398,7 +437,8 @@ clean_inode:
 	mark_inode_dirty(inode);
 
 	/* Free inode and index block from bitmap */
-	put_block(sbi, bno);
+	if (bno)
+		put_block(sbi, bno);
 	put_inode(sbi, ino);
 
 	return 0;
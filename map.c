@@ -0,0 +1,1429 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ouiche_fs - a simple educational filesystem for Linux
+ *
+ * Copyright (C) 2018 Redha Gouicem <redha.gouicem@lip6.fr>
+ */
+
+#define pr_fmt(fmt) "%s:%s: " fmt, KBUILD_MODNAME, __func__
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/slab.h>
+
+#include "ouichefs.h"
+#include "bitmap.h"
+
+/*
+ * Block map of regular files in normal mode
+ *
+ * The block map of a file translates its logical blocks into physical blocks.
+ * It is stored in one of two formats selected per inode:
+ *   - flat (default): one 32-bit entry per logical block, 0 for a hole. The
+ *     entries of the first OUICHEFS_PTRS blocks are in the index block, the
+ *     following ones in leaf blocks reached through the double and triple
+ *     indirect blocks of the inode. Missing indirect and leaf blocks are
+ *     holes, and are allocated when blocks are mapped below them;
+ *   - extents (OUICHEFS_INODE_EXTENTS): a sorted array of (logical start,
+ *     physical start, length) extents in the index block, so that a
+ *     contiguous file needs a handful of entries and a single lookup per I/O.
+ * With large inodes, a regular file has no index block (index_block is 0)
+ * until its map outgrows the inode: i_direct then holds the first
+ * OUICHEFS_NR_DIRECT entries of the flat format, or an extent block of
+ * OUICHEFS_INLINE_EXTENTS extents. Until its first block is needed, such a
+ * file is inline (OUICHEFS_INODE_INLINE): its data is in i_inline instead,
+ * and it has no block map at all (see ouichefs_map_uninline()).
+ * In both formats, OUICHEFS_UNWRITTEN flags blocks preallocated by fallocate()
+ * that were never written. The functions below hide the format from the rest
+ * of the filesystem. Lookups are done with ci->map_sem held for reading,
+ * modifications with ci->map_sem held for writing. The index block is read
+ * through a copy cached in the inode (see ouichefs_index_cache_get()).
+ * Insert mode uses its own flat format (see file.c) and never goes through
+ * these functions, except ouichefs_map_truncate().
+ */
+
+/*
+ * Return the index of the first extent of eb ending after iblock, or
+ * eb->nr_extents if there is none.
+ */
+static uint32_t ouichefs_ext_search(struct ouichefs_extent_block *eb,
+				    sector_t iblock)
+{
+	uint32_t lo = 0, hi = eb->nr_extents, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (eb->extents[mid].ee_block + eb->extents[mid].ee_len <=
+		    iblock)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* True if extent b directly follows extent a, logically and physically */
+static inline bool ouichefs_ext_mergeable(struct ouichefs_extent *a,
+					  struct ouichefs_extent *b)
+{
+	return a->ee_block + a->ee_len == b->ee_block &&
+	       a->ee_start + a->ee_len == b->ee_start;
+}
+
+/* Merge extent i of eb with the next one if they are contiguous */
+static void ouichefs_ext_merge_next(struct ouichefs_extent_block *eb,
+				    uint32_t i)
+{
+	if (i + 1 >= eb->nr_extents ||
+	    !ouichefs_ext_mergeable(&eb->extents[i], &eb->extents[i + 1]))
+		return;
+
+	eb->extents[i].ee_len += eb->extents[i + 1].ee_len;
+	memmove(&eb->extents[i + 1], &eb->extents[i + 2],
+		(eb->nr_extents - i - 2) * sizeof(struct ouichefs_extent));
+	eb->nr_extents--;
+}
+
+static void ouichefs_ext_lookup(struct ouichefs_extent_block *eb,
+				sector_t iblock, uint32_t max, uint32_t *entry,
+				uint32_t *len)
+{
+	uint32_t i = ouichefs_ext_search(eb, iblock);
+	struct ouichefs_extent *ex = &eb->extents[i];
+
+	if (i == eb->nr_extents) {
+		/* Hole up to the end of the file */
+		*entry = 0;
+		*len = max;
+	} else if (ex->ee_block > iblock) {
+		/* Hole up to the next extent */
+		*entry = 0;
+		*len = min_t(uint32_t, max, ex->ee_block - iblock);
+	} else {
+		*entry = ex->ee_start + (iblock - ex->ee_block);
+		*len = min_t(uint32_t, max,
+			     ex->ee_block + ex->ee_len - iblock);
+	}
+}
+
+/*
+ * Map the len logical blocks starting at iblock to the physical blocks
+ * starting at entry, replacing the parts of the extents they overlap.
+ * Return 0 on success, -ENOSPC if the extent block would need more than
+ * max_extents extents.
+ */
+static int ouichefs_ext_set(struct ouichefs_extent_block *eb, sector_t iblock,
+			    uint32_t entry, uint32_t len, uint32_t max_extents)
+{
+	struct ouichefs_extent new[3];
+	struct ouichefs_extent *ex;
+	uint32_t first, last, nr_new = 0, i;
+	sector_t end = iblock + len;
+
+	/* Overlapped extents are first to last - 1 */
+	first = ouichefs_ext_search(eb, iblock);
+	for (last = first;
+	     last < eb->nr_extents && eb->extents[last].ee_block < end; last++)
+		;
+
+	/* Keep the parts of the overlapped extents outside of the range */
+	if (first < last && eb->extents[first].ee_block < iblock) {
+		ex = &eb->extents[first];
+		new[nr_new++] = (struct ouichefs_extent){
+			.ee_block = ex->ee_block,
+			.ee_start = ex->ee_start,
+			.ee_len = iblock - ex->ee_block,
+		};
+	}
+	new[nr_new++] = (struct ouichefs_extent){
+		.ee_block = iblock,
+		.ee_start = entry,
+		.ee_len = len,
+	};
+	if (first < last) {
+		ex = &eb->extents[last - 1];
+		if (ex->ee_block + ex->ee_len > end)
+			new[nr_new++] = (struct ouichefs_extent){
+				.ee_block = end,
+				.ee_start =
+					ex->ee_start + (end - ex->ee_block),
+				.ee_len = ex->ee_block + ex->ee_len - end,
+			};
+	}
+
+	if (eb->nr_extents - (last - first) + nr_new > max_extents)
+		return -ENOSPC;
+
+	memmove(&eb->extents[first + nr_new], &eb->extents[last],
+		(eb->nr_extents - last) * sizeof(struct ouichefs_extent));
+	memcpy(&eb->extents[first], new, nr_new * sizeof(*new));
+	eb->nr_extents += nr_new - (last - first);
+
+	/* Merge the new extents with their neighbours, from the last one */
+	for (i = first + nr_new; i-- > first;)
+		ouichefs_ext_merge_next(eb, i);
+	if (first)
+		ouichefs_ext_merge_next(eb, first - 1);
+
+	return 0;
+}
+
+/*
+ * Index block cache
+ *
+ * Every lookup of a file of up to OUICHEFS_PTRS blocks, and every lookup of an
+ * extent file, reads its index block. To avoid a buffer cache lookup per data
+ * block, a copy of the index block is kept in ci->index_cache from its first
+ * read on. Modifications are done on the buffer of the index block, with
+ * ci->map_sem held for writing, then copied to the cache so that it stays
+ * coherent with the disk. Cached inodes are listed in sbi->index_cache_inodes,
+ * and a shrinker frees the copies of the least recently used ones under memory
+ * pressure.
+ * Lock order: ci->map_sem, then sbi->index_cache_lock. The shrinker only tries
+ * to take ci->map_sem.
+ */
+
+/*
+ * Return the content of the index block of a file: its cached copy (*bh is
+ * then NULL), or its buffer, read in *bh, if the copy could not be allocated.
+ * Return NULL if the index block could not be read. Called with ci->map_sem
+ * held, which keeps the copy alive, and followed by brelse(*bh).
+ */
+void *ouichefs_index_cache_get(struct inode *inode, struct buffer_head **bh)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	void *copy;
+
+	*bh = NULL;
+	WRITE_ONCE(ci->index_cache_ref, true);
+	copy = READ_ONCE(ci->index_cache);
+	if (copy)
+		return copy;
+
+	*bh = sb_bread(inode->i_sb, ci->index_block);
+	if (!*bh)
+		return NULL;
+	copy = kmalloc(OUICHEFS_BLOCK_SIZE, GFP_NOFS);
+	if (!copy)
+		return (*bh)->b_data;
+	memcpy(copy, (*bh)->b_data, OUICHEFS_BLOCK_SIZE);
+	brelse(*bh);
+	*bh = NULL;
+
+	/* Concurrent lookups may have cached the index block meanwhile */
+	spin_lock(&sbi->index_cache_lock);
+	if (!ci->index_cache) {
+		WRITE_ONCE(ci->index_cache, copy);
+		list_add(&ci->index_cache_list, &sbi->index_cache_inodes);
+		sbi->nr_index_cached++;
+		copy = NULL;
+	}
+	spin_unlock(&sbi->index_cache_lock);
+	kfree(copy);
+
+	return ci->index_cache;
+}
+
+/*
+ * Insert mode offsets
+ *
+ * In insert mode, the byte offset of a block is the sum of the sizes (12 most
+ * significant bits) of the entries before it. To find the block of an offset
+ * without adding up the whole index, a Fenwick tree of the sizes is kept next
+ * to the cached index block, in ci->insert_sums: node k (from 1) holds the sum
+ * of the sizes of entries k - (k & -k) to k - 1, and is stored at index k - 1.
+ * It is built on the first lookup of a cached index block, updated with every
+ * modification of the cache and freed with it.
+ */
+
+#define OUICHEFS_INSERT_SIZE(entry) ((entry) >> 20)
+
+static void ouichefs_insert_sums_add(uint32_t *sums, uint32_t i,
+				     int32_t delta)
+{
+	for (i++; i <= OUICHEFS_PTRS; i += i & -i)
+		sums[i - 1] += delta;
+}
+
+static void ouichefs_insert_sums_build(uint32_t *sums, const uint32_t *index)
+{
+	uint32_t k, parent;
+
+	for (k = 1; k <= OUICHEFS_PTRS; k++)
+		sums[k - 1] = OUICHEFS_INSERT_SIZE(index[k - 1]);
+	for (k = 1; k <= OUICHEFS_PTRS; k++) {
+		parent = k + (k & -k);
+		if (parent <= OUICHEFS_PTRS)
+			sums[parent - 1] += sums[k - 1];
+	}
+}
+
+/*
+ * Bring the Fenwick tree of the cached index block old up to date with its new
+ * content. A write in a block changes a single size, an insertion or a
+ * defragmentation shifts all the following ones: the tree is then rebuilt.
+ */
+static void ouichefs_insert_sums_update(uint32_t *sums, const uint32_t *old,
+					const uint32_t *new)
+{
+	uint32_t i, changed = 0;
+
+	for (i = 0; i < OUICHEFS_PTRS; i++) {
+		if (OUICHEFS_INSERT_SIZE(old[i]) ==
+		    OUICHEFS_INSERT_SIZE(new[i]))
+			continue;
+		if (++changed > OUICHEFS_PTRS_BITS) {
+			ouichefs_insert_sums_build(sums, new);
+			return;
+		}
+		ouichefs_insert_sums_add(sums, i,
+					 OUICHEFS_INSERT_SIZE(new[i]) -
+					 OUICHEFS_INSERT_SIZE(old[i]));
+	}
+}
+
+/*
+ * Return the sum of the sizes of the first n insert mode entries.
+ */
+uint32_t ouichefs_insert_sums_prefix(const uint32_t *sums, uint32_t n)
+{
+	uint32_t sum = 0;
+
+	for (; n; n -= n & -n)
+		sum += sums[n - 1];
+
+	return sum;
+}
+
+/*
+ * Return the number of leading insert mode entries whose sizes add up to at
+ * most offset, and their total size in *sum.
+ */
+uint32_t ouichefs_insert_sums_find(const uint32_t *sums, loff_t offset,
+				   uint32_t *sum)
+{
+	uint32_t k = 0, step;
+
+	*sum = 0;
+	for (step = OUICHEFS_PTRS; step; step >>= 1) {
+		if (*sum + sums[k + step - 1] > offset)
+			continue;
+		k += step;
+		*sum += sums[k - 1];
+		if (k == OUICHEFS_PTRS)
+			break;
+	}
+
+	return k;
+}
+
+/*
+ * Return the Fenwick tree of the insert mode sizes of a file, built from its
+ * cached index block if needed. Return NULL if the index block is not cached
+ * or the tree could not be allocated. Called with ci->map_sem held.
+ */
+const uint32_t *ouichefs_insert_sums_get(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh;
+	uint32_t *sums;
+	void *index;
+
+	sums = READ_ONCE(ci->insert_sums);
+	if (sums)
+		return sums;
+
+	index = ouichefs_index_cache_get(inode, &bh);
+	if (bh) {
+		brelse(bh);
+		return NULL;
+	}
+	if (!index)
+		return NULL;
+	sums = kmalloc(OUICHEFS_PTRS * sizeof(*sums), GFP_NOFS);
+	if (!sums)
+		return NULL;
+	ouichefs_insert_sums_build(sums, index);
+
+	/* Concurrent lookups with ci->map_sem held for reading */
+	if (cmpxchg(&ci->insert_sums, NULL, sums)) {
+		kfree(sums);
+		sums = ci->insert_sums;
+	}
+
+	return sums;
+}
+
+/*
+ * Copy the index block of a file, modified in its buffer (index), to its
+ * cached copy. Called with ci->map_sem held for writing.
+ */
+static void __ouichefs_index_cache_update(struct inode *inode,
+					  const void *index)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	if (!ci->index_cache)
+		return;
+	if (ci->insert_sums)
+		ouichefs_insert_sums_update(ci->insert_sums, ci->index_cache,
+					    index);
+	memcpy(ci->index_cache, index, OUICHEFS_BLOCK_SIZE);
+}
+
+/*
+ * Same as __ouichefs_index_cache_update(), for the insert mode functions that
+ * modify the index block without holding ci->map_sem.
+ */
+void ouichefs_index_cache_update(struct inode *inode, const void *index)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	down_write(&ci->map_sem);
+	__ouichefs_index_cache_update(inode, index);
+	up_write(&ci->map_sem);
+}
+
+/*
+ * Free the cached copy of the index block of a file. Called with ci->map_sem
+ * held for writing, or when the inode is evicted.
+ */
+void ouichefs_index_cache_drop(struct inode *inode)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(inode->i_sb);
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	void *copy;
+
+	spin_lock(&sbi->index_cache_lock);
+	copy = ci->index_cache;
+	WRITE_ONCE(ci->index_cache, NULL);
+	if (!list_empty(&ci->index_cache_list)) {
+		list_del_init(&ci->index_cache_list);
+		sbi->nr_index_cached--;
+	}
+	spin_unlock(&sbi->index_cache_lock);
+	kfree(copy);
+	kfree(ci->insert_sums);
+	ci->insert_sums = NULL;
+}
+
+static unsigned long ouichefs_index_cache_count(struct shrinker *shrink,
+						struct shrink_control *sc)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(shrink, struct ouichefs_sb_info, index_shrinker);
+
+	return READ_ONCE(sbi->nr_index_cached) ?: SHRINK_EMPTY;
+}
+
+/*
+ * Free the cached index blocks of the least recently used inodes. Inodes are
+ * scanned from the oldest and moved to the head of the list: an inode whose
+ * copy was looked up since the last scan gets a second chance, as does an
+ * inode whose block map is in use.
+ */
+static unsigned long ouichefs_index_cache_scan(struct shrinker *shrink,
+					       struct shrink_control *sc)
+{
+	struct ouichefs_sb_info *sbi =
+		container_of(shrink, struct ouichefs_sb_info, index_shrinker);
+	struct ouichefs_inode_info *ci;
+	unsigned long freed = 0;
+	uint32_t *sums;
+	void *copy;
+
+	spin_lock(&sbi->index_cache_lock);
+	while (sc->nr_to_scan && !list_empty(&sbi->index_cache_inodes)) {
+		sc->nr_to_scan--;
+		ci = list_last_entry(&sbi->index_cache_inodes,
+				     struct ouichefs_inode_info,
+				     index_cache_list);
+		list_move(&ci->index_cache_list, &sbi->index_cache_inodes);
+		if (READ_ONCE(ci->index_cache_ref)) {
+			WRITE_ONCE(ci->index_cache_ref, false);
+			continue;
+		}
+		if (!down_write_trylock(&ci->map_sem))
+			continue;
+		copy = ci->index_cache;
+		WRITE_ONCE(ci->index_cache, NULL);
+		sums = ci->insert_sums;
+		ci->insert_sums = NULL;
+		list_del_init(&ci->index_cache_list);
+		sbi->nr_index_cached--;
+		up_write(&ci->map_sem);
+
+		kfree(copy);
+		kfree(sums);
+		freed++;
+	}
+	spin_unlock(&sbi->index_cache_lock);
+
+	return freed;
+}
+
+int ouichefs_index_cache_register(struct super_block *sb)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+
+	spin_lock_init(&sbi->index_cache_lock);
+	INIT_LIST_HEAD(&sbi->index_cache_inodes);
+	sbi->nr_index_cached = 0;
+	sbi->index_shrinker.count_objects = ouichefs_index_cache_count;
+	sbi->index_shrinker.scan_objects = ouichefs_index_cache_scan;
+	sbi->index_shrinker.seeks = DEFAULT_SEEKS;
+
+	return register_shrinker(&sbi->index_shrinker, "ouichefs-index:%s",
+				 sb->s_id);
+}
+
+void ouichefs_index_cache_unregister(struct ouichefs_sb_info *sbi)
+{
+	unregister_shrinker(&sbi->index_shrinker);
+}
+
+/*
+ * Return the extent block of an extent file: in the inode if it has no index
+ * block, else in its index block (see ouichefs_index_cache_get()). Return
+ * NULL if the index block could not be read. Only for lookups.
+ */
+static struct ouichefs_extent_block *ouichefs_ext_get(struct inode *inode,
+						      struct buffer_head **bh)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	*bh = NULL;
+	if (!ci->index_block)
+		return (struct ouichefs_extent_block *)ci->i_direct;
+
+	return ouichefs_index_cache_get(inode, bh);
+}
+
+/*
+ * Return the content of the leaf block of the flat map of a file for a lookup:
+ * from the index block cache for the index block, else from its buffer, read
+ * in *bh. Return NULL if the block could not be read.
+ */
+static uint32_t *ouichefs_flat_read(struct inode *inode, uint32_t leaf,
+				    struct buffer_head **bh)
+{
+	if (leaf == OUICHEFS_INODE(inode)->index_block)
+		return ouichefs_index_cache_get(inode, bh);
+
+	*bh = sb_bread(inode->i_sb, leaf);
+	if (!*bh)
+		return NULL;
+	return (uint32_t *)(*bh)->b_data;
+}
+
+void ouichefs_map_cache_init(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	spin_lock_init(&ci->map_cache_lock);
+	ci->map_cache_leaf = 0;
+	ci->map_cache_base = 0;
+	ci->index_cache = NULL;
+	ci->insert_sums = NULL;
+	ci->index_cache_ref = false;
+	INIT_LIST_HEAD(&ci->index_cache_list);
+	xa_init(&ci->delayed);
+}
+
+static void ouichefs_map_cache_set(struct ouichefs_inode_info *ci,
+				   uint32_t leaf, sector_t base)
+{
+	spin_lock(&ci->map_cache_lock);
+	ci->map_cache_leaf = leaf;
+	ci->map_cache_base = base;
+	spin_unlock(&ci->map_cache_lock);
+}
+
+/*
+ * Allocate a zeroed indirect or leaf block near goal and account it in
+ * i_blocks. Return its number, or 0 if the disk is full.
+ */
+static uint32_t ouichefs_map_new_block(struct inode *inode, uint32_t goal)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh;
+	uint32_t bno;
+
+	bno = get_free_block(OUICHEFS_SB(sb), goal);
+	if (!bno)
+		return 0;
+
+	bh = sb_getblk(sb, bno);
+	if (!bh) {
+		put_block(OUICHEFS_SB(sb), bno);
+		return 0;
+	}
+	lock_buffer(bh);
+	memset(bh->b_data, 0, OUICHEFS_BLOCK_SIZE);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	inode->i_blocks++;
+	mark_inode_dirty(inode);
+
+	return bno;
+}
+
+/*
+ * Move the block map of a file from i_direct to a new index block allocated
+ * near goal. Both formats lay out the start of the map in i_direct as in the
+ * index block, so it is copied as is.
+ */
+static int __ouichefs_map_add_index(struct inode *inode, uint32_t goal)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh;
+	uint32_t bno;
+
+	if (ci->index_block)
+		return 0;
+	/* Forget the index block the file had before being truncated */
+	ouichefs_index_cache_drop(inode);
+
+	bno = ouichefs_map_new_block(inode, goal);
+	if (!bno)
+		return -ENOSPC;
+	bh = sb_bread(inode->i_sb, bno);
+	if (!bh) {
+		put_block(OUICHEFS_SB(inode->i_sb), bno);
+		inode->i_blocks--;
+		return -EIO;
+	}
+	memcpy(bh->b_data, ci->i_direct, sizeof(ci->i_direct));
+	mark_buffer_dirty(bh);
+	brelse(bh);
+
+	ci->index_block = bno;
+	memset(ci->i_direct, 0, sizeof(ci->i_direct));
+	mark_inode_dirty(inode);
+
+	return 0;
+}
+
+/*
+ * ouichefs_flat_leaf() - find the leaf of the flat block map holding iblock
+ * @inode:	the inode of the file
+ * @iblock:	the logical block
+ * @goal:	if not 0, allocate the missing indirect and leaf blocks near goal
+ * @leaf:	the leaf block, or 0 if it is missing
+ * @base:	the first logical block mapped by the leaf, or by the missing
+ *		subtree if the leaf is missing
+ * @span:	the number of logical blocks mapped by the leaf or by the missing
+ *		subtree
+ *
+ * The leaf of the last lookup is cached in the inode, so that sequential
+ * accesses only read the leaf instead of walking down the indirect blocks for
+ * every data block.
+ *
+ * Return: 0 on success, -EIO if an indirect block could not be read, -ENOSPC
+ * if a missing block could not be allocated.
+ */
+static int ouichefs_flat_leaf(struct inode *inode, sector_t iblock,
+			      uint32_t goal, uint32_t *leaf, sector_t *base,
+			      sector_t *span)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh;
+	uint32_t *root, *slot, bno;
+	sector_t first, off;
+	int level, shift;
+
+	if (iblock < OUICHEFS_PTRS) {
+		*leaf = ci->index_block;
+		*base = 0;
+		*span = OUICHEFS_PTRS;
+		return 0;
+	}
+
+	spin_lock(&ci->map_cache_lock);
+	if (ci->map_cache_leaf && iblock >= ci->map_cache_base &&
+	    iblock < ci->map_cache_base + OUICHEFS_PTRS) {
+		*leaf = ci->map_cache_leaf;
+		*base = ci->map_cache_base;
+		*span = OUICHEFS_PTRS;
+		spin_unlock(&ci->map_cache_lock);
+		return 0;
+	}
+	spin_unlock(&ci->map_cache_lock);
+
+	if (iblock < OUICHEFS_PTRS + OUICHEFS_DIND_BLOCKS) {
+		root = &ci->dind_block;
+		first = OUICHEFS_PTRS;
+		level = 2;
+	} else {
+		root = &ci->tind_block;
+		first = OUICHEFS_PTRS + OUICHEFS_DIND_BLOCKS;
+		level = 3;
+	}
+	off = iblock - first;
+
+	/* Walk down from the root, level being the height of block bno */
+	slot = root;
+	bh = NULL;
+	for (;;) {
+		shift = level * OUICHEFS_PTRS_BITS;
+		if (!*slot) {
+			if (!goal) {
+				brelse(bh);
+				*leaf = 0;
+				*base = first + (off & ~((1ULL << shift) - 1));
+				*span = 1ULL << shift;
+				return 0;
+			}
+			bno = ouichefs_map_new_block(inode, goal);
+			if (!bno) {
+				brelse(bh);
+				return -ENOSPC;
+			}
+			*slot = bno;
+			if (bh)
+				mark_buffer_dirty(bh);
+		}
+		bno = *slot;
+		brelse(bh);
+		if (--level == 0)
+			break;
+
+		bh = sb_bread(inode->i_sb, bno);
+		if (!bh)
+			return -EIO;
+		shift = level * OUICHEFS_PTRS_BITS;
+		slot = (uint32_t *)bh->b_data +
+		       ((off >> shift) & (OUICHEFS_PTRS - 1));
+	}
+
+	*leaf = bno;
+	*base = first + (off & ~(sector_t)(OUICHEFS_PTRS - 1));
+	*span = OUICHEFS_PTRS;
+	ouichefs_map_cache_set(ci, *leaf, *base);
+
+	return 0;
+}
+
+/* Return the number of entries of blocks (at most max) in the same run */
+static uint32_t ouichefs_flat_run(uint32_t *blocks, uint32_t max)
+{
+	uint32_t i;
+
+	for (i = 1; i < max; i++) {
+		if (blocks[i] != (blocks[0] ? blocks[0] + i : 0))
+			break;
+	}
+
+	return i;
+}
+
+static int ouichefs_flat_lookup(struct inode *inode, sector_t iblock,
+				uint32_t max, uint32_t *entry, uint32_t *len)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh;
+	uint32_t leaf, *blocks;
+	sector_t base, span;
+	int ret;
+
+	if (!ci->index_block) {
+		if (iblock >= OUICHEFS_NR_DIRECT) {
+			*entry = 0;
+			*len = max;
+			return 0;
+		}
+		blocks = ci->i_direct + iblock;
+		*entry = blocks[0];
+		*len = ouichefs_flat_run(blocks,
+					 min_t(uint32_t, max,
+					       OUICHEFS_NR_DIRECT - iblock));
+		return 0;
+	}
+
+	ret = ouichefs_flat_leaf(inode, iblock, 0, &leaf, &base, &span);
+	if (ret)
+		return ret;
+	max = min_t(sector_t, max, base + span - iblock);
+	if (!leaf) {
+		*entry = 0;
+		*len = max;
+		return 0;
+	}
+
+	blocks = ouichefs_flat_read(inode, leaf, &bh);
+	if (!blocks)
+		return -EIO;
+	blocks += iblock - base;
+	*entry = blocks[0];
+	*len = ouichefs_flat_run(blocks, max);
+	brelse(bh);
+
+	return 0;
+}
+
+static int ouichefs_flat_set(struct inode *inode, sector_t iblock,
+			     uint32_t entry, uint32_t len)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh;
+	uint32_t leaf, *blocks, n, i;
+	sector_t base, span;
+	int ret;
+
+	if (!ci->index_block) {
+		if (iblock + len <= OUICHEFS_NR_DIRECT) {
+			for (i = 0; i < len; i++)
+				ci->i_direct[iblock + i] = entry ? entry + i : 0;
+			mark_inode_dirty(inode);
+			return 0;
+		}
+		ret = __ouichefs_map_add_index(inode,
+					       ouichefs_index_bno(entry));
+		if (ret)
+			return ret;
+	}
+
+	while (len) {
+		/* Missing blocks of the map go right after the data */
+		ret = ouichefs_flat_leaf(inode, iblock,
+					 ouichefs_index_bno(entry) + len, &leaf,
+					 &base, &span);
+		if (ret)
+			return ret;
+
+		bh = sb_bread(inode->i_sb, leaf);
+		if (!bh)
+			return -EIO;
+		blocks = (uint32_t *)bh->b_data + (iblock - base);
+		n = min_t(sector_t, len, base + span - iblock);
+		for (i = 0; i < n; i++)
+			blocks[i] = entry ? entry + i : 0;
+		mark_buffer_dirty(bh);
+		if (leaf == ci->index_block)
+			__ouichefs_index_cache_update(inode, bh->b_data);
+		brelse(bh);
+
+		iblock += n;
+		if (entry)
+			entry += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Free a mapped block of a file, zeroing it first if scrub is set. The buffers
+ * of the block (insert mode writes leave dirty ones until fsync) are cleaned
+ * before the block can be reallocated: written back later, they would
+ * overwrite the data of its next owner.
+ */
+static void ouichefs_map_free(struct inode *inode, uint32_t entry, bool scrub)
+{
+	struct super_block *sb = inode->i_sb;
+	uint32_t bno = ouichefs_index_bno(entry);
+	struct buffer_head *bh;
+
+	/* Unwritten blocks were never written */
+	if (scrub && !(entry & OUICHEFS_UNWRITTEN)) {
+		bh = sb_bread(sb, bno);
+		if (bh) {
+			memset(bh->b_data, 0, OUICHEFS_BLOCK_SIZE);
+			mark_buffer_dirty(bh);
+			sync_dirty_buffer(bh);
+			brelse(bh);
+		}
+	}
+	clean_bdev_aliases(sb->s_bdev, bno, 1);
+	put_block(OUICHEFS_SB(sb), bno);
+}
+
+/*
+ * Free the blocks mapped below the indirect or leaf block bno (a leaf if
+ * level is 0), then bno itself.
+ */
+static void ouichefs_flat_free_tree(struct inode *inode, uint32_t bno,
+				    int level, bool scrub)
+{
+	struct buffer_head *bh;
+	uint32_t *blocks, i;
+
+	bh = sb_bread(inode->i_sb, bno);
+	if (bh) {
+		blocks = (uint32_t *)bh->b_data;
+		for (i = 0; i < OUICHEFS_PTRS; i++) {
+			if (!blocks[i])
+				continue;
+			if (level)
+				ouichefs_flat_free_tree(inode, blocks[i],
+							level - 1, scrub);
+			else
+				ouichefs_map_free(inode, blocks[i], scrub);
+		}
+		/* Indirect blocks are metadata, do not leave them in cache */
+		bforget(bh);
+	}
+	put_block(OUICHEFS_SB(inode->i_sb), bno);
+}
+
+/*
+ * ouichefs_map_lookup() - look up the block map of a file
+ * @inode:	the inode of the file
+ * @iblock:	the first logical block to look up
+ * @max:	the maximum number of blocks to look up
+ * @entry:	the physical block of iblock, with OUICHEFS_UNWRITTEN if it is
+ *		unwritten, or 0 if iblock is a hole
+ * @len:	the number of blocks from iblock (at most max) that are in the
+ *		same state as iblock and physically contiguous
+ *
+ * Return: 0 on success, -EFBIG if iblock is past the maximum file size, -EIO if
+ * the block map could not be read. Inline files read as a single hole.
+ */
+int ouichefs_map_lookup(struct inode *inode, sector_t iblock, uint32_t max,
+			uint32_t *entry, uint32_t *len)
+{
+	struct ouichefs_extent_block *eb;
+	struct buffer_head *bh_index;
+
+	if (iblock >= OUICHEFS_MAP_BLOCKS)
+		return -EFBIG;
+	max = min_t(sector_t, max, OUICHEFS_MAP_BLOCKS - iblock);
+
+	/* An inline file has no block */
+	if (ouichefs_is_inline(inode)) {
+		*entry = 0;
+		*len = max;
+		return 0;
+	}
+
+	if (!ouichefs_has_extents(inode))
+		return ouichefs_flat_lookup(inode, iblock, max, entry, len);
+
+	eb = ouichefs_ext_get(inode, &bh_index);
+	if (!eb)
+		return -EIO;
+	ouichefs_ext_lookup(eb, iblock, max, entry, len);
+	brelse(bh_index);
+
+	return 0;
+}
+
+/*
+ * ouichefs_map_set() - map logical blocks of a file
+ * @inode:	the inode of the file
+ * @iblock:	the first logical block to map
+ * @entry:	the first physical block, with OUICHEFS_UNWRITTEN if unwritten
+ * @len:	the number of blocks to map
+ *
+ * Map the len logical blocks starting at iblock to the physical blocks
+ * starting at entry. Used to fill holes and to mark unwritten blocks as
+ * written.
+ *
+ * Return: 0 on success, -EFBIG if the range is past the maximum file size, -EIO
+ * if the block map could not be read, -ENOSPC if the extent block of the file
+ * is full or if a block of the flat map could not be allocated.
+ */
+int ouichefs_map_set(struct inode *inode, sector_t iblock, uint32_t entry,
+		     uint32_t len)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_extent_block *eb;
+	struct buffer_head *bh_index;
+	int ret;
+
+	if (iblock + len > OUICHEFS_MAP_BLOCKS)
+		return -EFBIG;
+	/* The caller must call ouichefs_map_uninline() first */
+	if (WARN_ON_ONCE(ouichefs_is_inline(inode)))
+		return -EIO;
+	if (!ouichefs_has_extents(inode))
+		return ouichefs_flat_set(inode, iblock, entry, len);
+
+	if (!ci->index_block) {
+		/* Extents in the inode, move them to an index block if full */
+		eb = (struct ouichefs_extent_block *)ci->i_direct;
+		ret = ouichefs_ext_set(eb, iblock, entry, len,
+				       OUICHEFS_INLINE_EXTENTS);
+		if (!ret) {
+			mark_inode_dirty(inode);
+			return 0;
+		}
+		ret = __ouichefs_map_add_index(inode,
+					       ouichefs_index_bno(entry));
+		if (ret)
+			return ret;
+		return ouichefs_map_set(inode, iblock, entry, len);
+	}
+
+	bh_index = sb_bread(inode->i_sb, ci->index_block);
+	if (!bh_index)
+		return -EIO;
+	eb = (struct ouichefs_extent_block *)bh_index->b_data;
+	ret = ouichefs_ext_set(eb, iblock, entry, len, OUICHEFS_MAX_EXTENTS);
+	if (!ret) {
+		mark_buffer_dirty(bh_index);
+		__ouichefs_index_cache_update(inode, bh_index->b_data);
+	}
+	brelse(bh_index);
+
+	return ret;
+}
+
+/*
+ * Return the preferred physical block for the iblock-th block of a file: the
+ * block right after the closest allocated block preceding iblock, or right
+ * after the index block for the first block of the file. Allocating from
+ * there keeps files written sequentially contiguous on disk.
+ */
+uint32_t ouichefs_map_goal(struct inode *inode, sector_t iblock)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct ouichefs_extent_block *eb;
+	struct ouichefs_extent *ex;
+	struct buffer_head *bh;
+	uint32_t goal, leaf, entry, len, *blocks, i;
+	sector_t base, span;
+
+	/* Without index block, start with the first block of the group */
+	if (ci->index_block)
+		goal = ci->index_block + 1;
+	else
+		goal = ouichefs_ino_group(OUICHEFS_SB(inode->i_sb),
+					  inode->i_ino)->first_block;
+
+	if (ouichefs_has_extents(inode)) {
+		eb = ouichefs_ext_get(inode, &bh);
+		if (!eb)
+			return goal;
+		i = ouichefs_ext_search(eb, iblock);
+		if (i < eb->nr_extents && eb->extents[i].ee_block < iblock)
+			ex = &eb->extents[i];
+		else
+			ex = i ? &eb->extents[i - 1] : NULL;
+		if (ex)
+			goal = ouichefs_index_bno(ex->ee_start) +
+			       min_t(uint32_t, iblock - ex->ee_block,
+				     ex->ee_len);
+		brelse(bh);
+		return goal;
+	}
+
+	if (!ci->index_block) {
+		for (i = min_t(sector_t, iblock, OUICHEFS_NR_DIRECT); i-- > 0;) {
+			if (ci->i_direct[i])
+				return ouichefs_index_bno(ci->i_direct[i]) + 1;
+		}
+		return goal;
+	}
+
+	/* Closest mapped block before iblock in its leaf */
+	if (ouichefs_flat_leaf(inode, iblock, 0, &leaf, &base, &span))
+		return goal;
+	if (leaf) {
+		blocks = ouichefs_flat_read(inode, leaf, &bh);
+		if (!blocks)
+			return goal;
+		for (i = iblock - base; i-- > 0;) {
+			if (blocks[i]) {
+				goal = ouichefs_index_bno(blocks[i]) + 1;
+				brelse(bh);
+				return goal;
+			}
+		}
+		brelse(bh);
+		goal = leaf + 1;
+	}
+
+	/* Else, the last block of the previous leaf */
+	if (base && !ouichefs_flat_lookup(inode, base - 1, 1, &entry, &len) &&
+	    entry)
+		goal = ouichefs_index_bno(entry) + 1;
+
+	return goal;
+}
+
+/*
+ * ouichefs_map_alloc() - allocate the holes of a file
+ * @inode:	the inode of the file
+ * @first:	the first logical block to fill
+ * @last:	the last logical block to fill (included)
+ * @flags:	bits to add to the mapped blocks (OUICHEFS_UNWRITTEN or 0)
+ *
+ * Fill the holes of the file between first and last with newly allocated
+ * blocks, with one allocator call per hole so that each hole gets a single
+ * extent if possible, and account them in i_blocks.
+ *
+ * Return: 0 on success, -EIO or -ENOSPC on failure. In the latter case, the
+ * holes filled so far are kept.
+ */
+int ouichefs_map_alloc(struct inode *inode, sector_t first, sector_t last,
+		       uint32_t flags)
+{
+	sector_t i = first;
+	uint32_t entry, len, bno, got, j;
+	int ret;
+
+	ret = ouichefs_map_uninline(inode);
+	if (ret)
+		return ret;
+
+	while (i <= last) {
+		ret = ouichefs_map_lookup(inode, i, last - i + 1, &entry, &len);
+		if (ret)
+			return ret;
+		if (entry) {
+			i += len;
+			continue;
+		}
+
+		bno = get_free_file_blocks(inode, ouichefs_map_goal(inode, i),
+					   len, &got);
+		if (!bno)
+			return -ENOSPC;
+		ret = ouichefs_map_set(inode, i, bno | flags, got);
+		if (ret) {
+			for (j = 0; j < got; j++)
+				put_block(OUICHEFS_SB(inode->i_sb), bno + j);
+			return ret;
+		}
+		inode->i_blocks += got;
+		mark_inode_dirty(inode);
+		i += got;
+	}
+
+	return 0;
+}
+
+/*
+ * ouichefs_map_convert() - mark the unwritten blocks of a file as written
+ * @inode:	the inode of the file
+ * @first:	the first logical block to convert
+ * @last:	the last logical block to convert (included)
+ *
+ * Mark the unwritten blocks between first and last as written, once their data
+ * is on the disk. Each run of contiguous unwritten blocks is converted at once,
+ * so that an extent is only split at the ends of the range, and merged with
+ * the written extents around it. Called with ci->map_sem held for writing.
+ *
+ * Return: 0 on success, -EIO or -ENOSPC on failure. In the latter case, the
+ * runs converted so far are kept.
+ */
+int ouichefs_map_convert(struct inode *inode, sector_t first, sector_t last)
+{
+	sector_t i = first;
+	uint32_t entry, len;
+	int ret;
+
+	while (i <= last) {
+		ret = ouichefs_map_lookup(inode, i, last - i + 1, &entry, &len);
+		if (ret)
+			return ret;
+		if (entry & OUICHEFS_UNWRITTEN) {
+			ret = ouichefs_map_set(inode, i,
+					       ouichefs_index_bno(entry), len);
+			if (ret)
+				return ret;
+		}
+		i += len;
+	}
+
+	return 0;
+}
+
+/*
+ * Return the number of extents that can still be added to the map of an extent
+ * file, or -EIO if its index block could not be read. Marking a part of an
+ * unwritten extent as written adds up to two extents. Called with ci->map_sem
+ * held.
+ */
+int ouichefs_ext_room(struct inode *inode)
+{
+	struct ouichefs_extent_block *eb;
+	struct buffer_head *bh_index;
+	int room;
+
+	eb = ouichefs_ext_get(inode, &bh_index);
+	if (!eb)
+		return -EIO;
+	/* Extents in the inode move to an index block when full */
+	room = OUICHEFS_MAX_EXTENTS - eb->nr_extents;
+	brelse(bh_index);
+
+	return room;
+}
+
+/*
+ * Delayed allocation
+ *
+ * Buffered writes to holes only reserve blocks (see ouichefs_reserve_blocks())
+ * and record the file blocks in ci->delayed. The blocks are allocated when the
+ * data is written back, one extent per run of delayed blocks, so that data
+ * rewritten or truncated before it is flushed never gets blocks. ci->delayed
+ * is modified with ci->map_sem held for writing.
+ */
+
+/* Return the number of delayed blocks starting at iblock, at most max */
+uint32_t ouichefs_delayed_run(struct inode *inode, sector_t iblock,
+			      uint32_t max)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	uint32_t n = 0;
+
+	while (n < max && xa_load(&ci->delayed, iblock + n))
+		n++;
+
+	return n;
+}
+
+/*
+ * ouichefs_delayed_reserve() - reserve blocks for holes of a file
+ * @inode:	the inode of the file
+ * @iblock:	the first hole, which must not be delayed
+ * @max:	the number of holes from iblock
+ *
+ * Reserve blocks for the holes starting at iblock, up to max or up to the next
+ * delayed block, and record them as delayed.
+ *
+ * Return: the number of blocks reserved, -ENOSPC if the disk is full or
+ * -ENOMEM.
+ */
+int ouichefs_delayed_reserve(struct inode *inode, sector_t iblock,
+			     uint32_t max)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	unsigned long next = iblock;
+	uint32_t i;
+	int ret;
+
+	if (xa_find(&ci->delayed, &next, iblock + max - 1, XA_PRESENT))
+		max = next - iblock;
+	ret = ouichefs_reserve_blocks(OUICHEFS_SB(inode->i_sb), max);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < max; i++) {
+		ret = xa_err(xa_store(&ci->delayed, iblock + i, xa_mk_value(1),
+				      GFP_NOFS));
+		if (ret) {
+			ouichefs_release_blocks(OUICHEFS_SB(inode->i_sb),
+						max - i);
+			if (i)
+				ouichefs_delayed_release(inode, iblock,
+							 iblock + i - 1);
+			return ret;
+		}
+	}
+
+	return max;
+}
+
+/*
+ * Forget the delayed blocks of a file between first and last (included) and
+ * release their reservation, once they were allocated or their data dropped.
+ * Return the number of blocks released.
+ */
+uint32_t ouichefs_delayed_release(struct inode *inode, sector_t first,
+				  sector_t last)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	unsigned long index;
+	uint32_t n = 0;
+	void *entry;
+
+	xa_for_each_range(&ci->delayed, index, entry, first, last) {
+		xa_erase(&ci->delayed, index);
+		n++;
+	}
+	if (n)
+		ouichefs_release_blocks(OUICHEFS_SB(inode->i_sb), n);
+
+	return n;
+}
+
+/*
+ * ouichefs_map_truncate() - free all the blocks of a file
+ * @inode:	the inode of the file
+ * @scrub:	zero the written blocks on disk before freeing them
+ *
+ * The reservations of the delayed blocks are released as well: the page cache
+ * of the file must have been dropped before.
+ *
+ * Return: 0 on success, -EIO if the index block could not be read.
+ */
+int ouichefs_map_truncate(struct inode *inode, bool scrub)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct buffer_head *bh_index = NULL;
+	uint32_t entry, len, i, *blocks;
+	bool insert = ouichefs_insert_mode(inode);
+	sector_t iblock = 0;
+	int ret;
+
+	ouichefs_delayed_release(inode, 0, OUICHEFS_MAP_BLOCKS - 1);
+
+	if (ouichefs_is_inline(inode)) {
+		memset(ci->i_inline, 0, sizeof(ci->i_inline));
+		mark_inode_dirty(inode);
+		return 0;
+	}
+
+	if (ci->index_block) {
+		bh_index = sb_bread(inode->i_sb, ci->index_block);
+		if (!bh_index)
+			return -EIO;
+	}
+
+	if (ouichefs_has_extents(inode)) {
+		while (iblock < OUICHEFS_MAP_BLOCKS) {
+			ret = ouichefs_map_lookup(inode, iblock,
+						  OUICHEFS_MAP_BLOCKS, &entry,
+						  &len);
+			if (ret) {
+				brelse(bh_index);
+				return ret;
+			}
+			for (i = 0; entry && i < len; i++)
+				ouichefs_map_free(inode, entry + i, scrub);
+			iblock += len;
+		}
+	} else if (!bh_index) {
+		for (i = 0; i < OUICHEFS_NR_DIRECT; i++) {
+			if (ci->i_direct[i])
+				ouichefs_map_free(inode, ci->i_direct[i],
+						  scrub);
+		}
+	} else {
+		blocks = (uint32_t *)bh_index->b_data;
+		for (i = 0; i < OUICHEFS_PTRS; i++) {
+			/*
+			 * Insert mode entries hold their size in the 12 high
+			 * bits, and holes have no block
+			 */
+			entry = insert ? blocks[i] & 0x000FFFFF : blocks[i];
+			if (entry)
+				ouichefs_map_free(inode, entry, scrub);
+		}
+		if (ci->dind_block)
+			ouichefs_flat_free_tree(inode, ci->dind_block, 1,
+						scrub);
+		if (ci->tind_block)
+			ouichefs_flat_free_tree(inode, ci->tind_block, 2,
+						scrub);
+		ci->dind_block = 0;
+		ci->tind_block = 0;
+		ouichefs_map_cache_set(ci, 0, 0);
+	}
+
+	if (bh_index) {
+		memset(bh_index->b_data, 0, OUICHEFS_BLOCK_SIZE);
+		mark_buffer_dirty(bh_index);
+		__ouichefs_index_cache_update(inode, bh_index->b_data);
+		brelse(bh_index);
+	}
+	memset(ci->i_inline, 0, sizeof(ci->i_inline));
+
+	/* The index block, if any, is kept. Without it, the file is inline */
+	inode->i_blocks = ci->index_block ? 1 : 0;
+	if (!ci->index_block)
+		ci->i_flags |= OUICHEFS_INODE_INLINE;
+	mark_inode_dirty(inode);
+
+	return 0;
+}
+
+/*
+ * ouichefs_map_add_index() - give an index block to a file
+ * @inode:	the inode of the file
+ *
+ * Move the block map of a file without index block to a new index block, for
+ * insert mode which only works on index blocks. The data of an inline file is
+ * moved to a block first. Called with ci->map_sem held for writing.
+ *
+ * Return: 0 on success or if the file already has an index block, -ENOSPC or
+ * -EIO on failure.
+ */
+int ouichefs_map_add_index(struct inode *inode)
+{
+	int ret;
+
+	ret = ouichefs_map_uninline(inode);
+	if (ret)
+		return ret;
+
+	return __ouichefs_map_add_index(inode, ouichefs_map_goal(inode, 0));
+}
+
+/*
+ * ouichefs_map_uninline() - move the data of an inline file to a block
+ * @inode:	the inode of the file
+ *
+ * Give an empty block map to an inline file and, if it is not empty, move its
+ * data to a new block mapped as its first block. Called with ci->map_sem held
+ * for writing, before the first block of the file is allocated. The block is
+ * written synchronously, as callers may read it back through the page cache
+ * right away.
+ *
+ * Return: 0 on success or if the file is not inline, -ENOSPC or -EIO on
+ * failure. In the latter case, the file is still inline.
+ */
+int ouichefs_map_uninline(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh;
+	uint32_t bno;
+	int ret;
+
+	if (!ouichefs_is_inline(inode))
+		return 0;
+
+	if (!inode->i_size) {
+		ci->i_flags &= ~OUICHEFS_INODE_INLINE;
+		memset(ci->i_inline, 0, sizeof(ci->i_inline));
+		mark_inode_dirty(inode);
+		return 0;
+	}
+
+	/* The map is empty: start with the first block of the group */
+	bno = ouichefs_map_new_block(
+		inode,
+		ouichefs_ino_group(OUICHEFS_SB(sb), inode->i_ino)->first_block);
+	if (!bno)
+		return -ENOSPC;
+	bh = sb_bread(sb, bno);
+	if (!bh) {
+		ret = -EIO;
+		goto free_block;
+	}
+	memcpy(bh->b_data, ci->i_inline,
+	       min_t(loff_t, inode->i_size, OUICHEFS_INLINE_SIZE));
+	mark_buffer_dirty(bh);
+	sync_dirty_buffer(bh);
+
+	ci->i_flags &= ~OUICHEFS_INODE_INLINE;
+	memset(ci->i_inline, 0, sizeof(ci->i_inline));
+	ret = ouichefs_map_set(inode, 0, bno, 1);
+	if (ret) {
+		/* Put the data back in the inode */
+		memcpy(ci->i_inline, bh->b_data, sizeof(ci->i_inline));
+		ci->i_flags |= OUICHEFS_INODE_INLINE;
+		brelse(bh);
+		goto free_block;
+	}
+	brelse(bh);
+	mark_inode_dirty(inode);
+
+	return 0;
+
+free_block:
+	put_block(OUICHEFS_SB(sb), bno);
+	inode->i_blocks--;
+	mark_inode_dirty(inode);
+	return ret;
+}
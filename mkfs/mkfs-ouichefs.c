@@ -8,15 +8,19 @@
 #include <errno.h>
 #include <endian.h>
 #include <string.h>
+#include <stddef.h>
 
 #define OUICHEFS_MAGIC 0x48434957
 
 #define OUICHEFS_SB_BLOCK_NR 0
 
 #define OUICHEFS_BLOCK_SIZE (1 << 12) /* 4 KiB */
-#define OUICHEFS_MAX_FILESIZE (1 << 22) /* 4 MiB */
+#define OUICHEFS_MAX_FILESIZE (1 << 22) /* 4 MiB, in insert mode */
 #define OUICHEFS_FILENAME_LEN 28
 #define OUICHEFS_MAX_SUBFILES 128
+#define OUICHEFS_BLOCKS_PER_GROUP (OUICHEFS_BLOCK_SIZE * 8)
+#define OUICHEFS_NR_DIRECT 12
+#define OUICHEFS_INLINE_SIZE 176
 
 struct ouichefs_inode {
 	mode_t i_mode; /* File mode */
@@ -24,19 +28,28 @@ struct ouichefs_inode {
 	uint32_t i_gid; /* Group id */
 	uint32_t i_size; /* Size in bytes */
 	uint32_t i_ctime; /* Inode change time (sec)*/
+	uint32_t i_size_high; /* Size in bytes (high 32 bits) */
 	uint64_t i_nctime; /* Inode change time (nsec) */
 	uint32_t i_atime; /* Access time (sec) */
+	uint32_t i_dind_block; /* Double indirect block of the block map */
 	uint64_t i_natime; /* Access time (nsec) */
 	uint32_t i_mtime; /* Modification time (sec) */
+	uint32_t i_tind_block; /* Triple indirect block of the block map */
 	uint64_t i_nmtime; /* Modification time (nsec) */
 	uint32_t i_blocks; /* Block count (subdir count for directories) */
 	uint32_t i_nlink; /* Hard links count */
 	uint32_t index_block; /* Block with list of blocks for this file */
+	uint32_t i_flags; /* OUICHEFS_INODE_* flags */
+
+	/* Large inodes only (OUICHEFS_FEATURE_LARGE_INODES) */
+	union {
+		/* Block map, without index block */
+		uint32_t i_direct[OUICHEFS_NR_DIRECT];
+		/* Data of inline files */
+		char i_inline[OUICHEFS_INLINE_SIZE];
+	};
 };
 
-#define OUICHEFS_INODES_PER_BLOCK \
-	(OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode))
-
 struct ouichefs_superblock {
 	uint32_t magic; /* Magic number */
 
@@ -50,9 +63,33 @@ struct ouichefs_superblock {
 	uint32_t nr_free_inodes; /* Number of free inodes */
 	uint32_t nr_free_blocks; /* Number of free blocks */
 
-	char padding[4064]; /* Padding to match block size */
+	uint32_t nr_groups; /* Number of allocation groups, 0 if none */
+	uint32_t blocks_per_group; /* Number of blocks per group */
+	uint32_t inodes_per_group; /* Number of inodes per group */
+
+	uint32_t features; /* OUICHEFS_FEATURE_* flags */
+
+	char padding[4048]; /* Padding to match block size */
 };
 
+/* New regular files use the extent index format */
+#define OUICHEFS_FEATURE_EXTENTS 0x1
+/* Inodes are sizeof(struct ouichefs_inode) bytes, with i_direct */
+#define OUICHEFS_FEATURE_LARGE_INODES 0x2
+
+/* Returns the size of an on-disk inode with the given features */
+static inline uint32_t inode_size(uint32_t features)
+{
+	if (features & OUICHEFS_FEATURE_LARGE_INODES)
+		return sizeof(struct ouichefs_inode);
+	return offsetof(struct ouichefs_inode, i_direct);
+}
+
+static inline uint32_t inodes_per_block(uint32_t features)
+{
+	return OUICHEFS_BLOCK_SIZE / inode_size(features);
+}
+
 struct ouichefs_file_index_block {
 	uint32_t blocks[OUICHEFS_BLOCK_SIZE >> 2];
 };
@@ -68,7 +105,10 @@ static inline void usage(char *appname)
 {
 	fprintf(stderr,
 		"Usage:\n"
-		"%s disk\n",
+		"%s [-g] [-e] [-l] disk\n"
+		"\t-g: split the partition into allocation groups\n"
+		"\t-e: index new regular files with extents\n"
+		"\t-l: use large inodes, that hold the block map of small files\n",
 		appname);
 }
 
@@ -81,7 +121,8 @@ static inline uint32_t idiv_ceil(uint32_t a, uint32_t b)
 	return ret;
 }
 
-static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
+static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats,
+						    uint32_t features)
 {
 	int ret;
 	struct ouichefs_superblock *sb;
@@ -95,10 +136,10 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 
 	nr_blocks = fstats->st_size / OUICHEFS_BLOCK_SIZE;
 	nr_inodes = nr_blocks;
-	mod = nr_inodes % OUICHEFS_INODES_PER_BLOCK;
+	mod = nr_inodes % inodes_per_block(features);
 	if (mod != 0)
 		nr_inodes += mod;
-	nr_istore_blocks = idiv_ceil(nr_inodes, OUICHEFS_INODES_PER_BLOCK);
+	nr_istore_blocks = idiv_ceil(nr_inodes, inodes_per_block(features));
 	nr_ifree_blocks = idiv_ceil(nr_inodes, OUICHEFS_BLOCK_SIZE * 8);
 	nr_bfree_blocks = idiv_ceil(nr_blocks, OUICHEFS_BLOCK_SIZE * 8);
 	nr_data_blocks = nr_blocks - 1 - nr_istore_blocks - nr_ifree_blocks -
@@ -113,6 +154,7 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 	sb->nr_bfree_blocks = htole32(nr_bfree_blocks);
 	sb->nr_free_inodes = htole32(nr_inodes - 1);
 	sb->nr_free_blocks = htole32(nr_data_blocks - 1);
+	sb->features = htole32(features);
 
 	ret = write(fd, sb, sizeof(struct ouichefs_superblock));
 	if (ret != sizeof(struct ouichefs_superblock)) {
@@ -127,10 +169,12 @@ static struct ouichefs_superblock *write_superblock(int fd, struct stat *fstats)
 	       "\tnr_ifree_blocks=%u\n"
 	       "\tnr_bfree_blocks=%u\n"
 	       "\tnr_free_inodes=%u\n"
-	       "\tnr_free_blocks=%u\n",
+	       "\tnr_free_blocks=%u\n"
+	       "\tfeatures=%#x\n",
 	       sizeof(struct ouichefs_superblock), sb->magic, sb->nr_blocks,
 	       sb->nr_inodes, sb->nr_istore_blocks, sb->nr_ifree_blocks,
-	       sb->nr_bfree_blocks, sb->nr_free_inodes, sb->nr_free_blocks);
+	       sb->nr_bfree_blocks, sb->nr_free_inodes, sb->nr_free_blocks,
+	       sb->features);
 
 	return sb;
 }
@@ -150,7 +194,8 @@ static int write_inode_store(int fd, struct ouichefs_superblock *sb)
 	memset(block, 0, OUICHEFS_BLOCK_SIZE);
 
 	/* Root inode (inode 1) */
-	inode = (struct ouichefs_inode *)block + 1;
+	inode = (struct ouichefs_inode *)(block +
+					  inode_size(le32toh(sb->features)));
 	first_data_block = 1 + le32toh(sb->nr_bfree_blocks) +
 			   le32toh(sb->nr_ifree_blocks) +
 			   le32toh(sb->nr_istore_blocks);
@@ -184,8 +229,8 @@ static int write_inode_store(int fd, struct ouichefs_superblock *sb)
 	ret = 0;
 
 	printf("Inode store: wrote %d blocks\n"
-	       "\tinode size = %ld B\n",
-	       i, sizeof(struct ouichefs_inode));
+	       "\tinode size = %u B\n",
+	       i, inode_size(le32toh(sb->features)));
 
 end:
 	free(block);
@@ -334,20 +379,219 @@ static int write_data_blocks(int fd, struct ouichefs_superblock *sb)
 	return ret;
 }
 
+/*
+ * Allocation groups: the partition is split into groups of
+ * OUICHEFS_BLOCKS_PER_GROUP blocks (one bfree bitmap block), each with its own
+ * superblock copy, inode store, ifree bitmap, bfree bitmap and data blocks.
+ * The first inode of each group is reserved.
+ */
+static struct ouichefs_superblock *init_groups_superblock(struct stat *fstats,
+							  uint32_t features)
+{
+	struct ouichefs_superblock *sb;
+	uint32_t nr_blocks, nr_groups, ipg, nr_meta, last, nr_free_blocks;
+
+	sb = malloc(sizeof(struct ouichefs_superblock));
+	if (!sb)
+		return NULL;
+
+	nr_blocks = fstats->st_size / OUICHEFS_BLOCK_SIZE;
+
+	/* One inode for 4 blocks, rounded to a whole number of bitmap words */
+	ipg = nr_blocks < OUICHEFS_BLOCKS_PER_GROUP ? nr_blocks :
+						      OUICHEFS_BLOCKS_PER_GROUP;
+	ipg = idiv_ceil(ipg / 4, 64) * 64;
+	nr_meta = 1 + idiv_ceil(ipg, inodes_per_block(features)) +
+		  idiv_ceil(ipg, OUICHEFS_BLOCK_SIZE * 8) +
+		  idiv_ceil(OUICHEFS_BLOCKS_PER_GROUP, OUICHEFS_BLOCK_SIZE * 8);
+
+	/* Drop the last group if it cannot hold its metadata */
+	nr_groups = idiv_ceil(nr_blocks, OUICHEFS_BLOCKS_PER_GROUP);
+	last = nr_blocks - (nr_groups - 1) * OUICHEFS_BLOCKS_PER_GROUP;
+	if (last <= nr_meta) {
+		nr_groups--;
+		nr_blocks = nr_groups * OUICHEFS_BLOCKS_PER_GROUP;
+	}
+	if (!nr_groups) {
+		free(sb);
+		return NULL;
+	}
+	nr_free_blocks = nr_blocks - nr_groups * nr_meta - 1;
+
+	memset(sb, 0, sizeof(struct ouichefs_superblock));
+	sb->magic = htole32(OUICHEFS_MAGIC);
+	sb->nr_blocks = htole32(nr_blocks);
+	sb->nr_inodes = htole32(nr_groups * ipg);
+	sb->nr_istore_blocks =
+		htole32(idiv_ceil(ipg, inodes_per_block(features)));
+	sb->nr_ifree_blocks = htole32(idiv_ceil(ipg, OUICHEFS_BLOCK_SIZE * 8));
+	sb->nr_bfree_blocks =
+		htole32(idiv_ceil(OUICHEFS_BLOCKS_PER_GROUP, OUICHEFS_BLOCK_SIZE * 8));
+	sb->nr_free_inodes = htole32(nr_groups * ipg - nr_groups - 1);
+	sb->nr_free_blocks = htole32(nr_free_blocks);
+	sb->nr_groups = htole32(nr_groups);
+	sb->blocks_per_group = htole32(OUICHEFS_BLOCKS_PER_GROUP);
+	sb->inodes_per_group = htole32(ipg);
+	sb->features = htole32(features);
+
+	printf("Superblock: (%ld)\n"
+	       "\tmagic=%#x\n"
+	       "\tnr_blocks=%u\n"
+	       "\tnr_inodes=%u (istore=%u blocks per group)\n"
+	       "\tnr_ifree_blocks=%u per group\n"
+	       "\tnr_bfree_blocks=%u per group\n"
+	       "\tnr_free_inodes=%u\n"
+	       "\tnr_free_blocks=%u\n"
+	       "\tnr_groups=%u (%u blocks, %u inodes per group)\n"
+	       "\tfeatures=%#x\n",
+	       sizeof(struct ouichefs_superblock), sb->magic, sb->nr_blocks,
+	       sb->nr_inodes, sb->nr_istore_blocks, sb->nr_ifree_blocks,
+	       sb->nr_bfree_blocks, sb->nr_free_inodes, sb->nr_free_blocks,
+	       sb->nr_groups, sb->blocks_per_group, sb->inodes_per_group,
+	       sb->features);
+
+	return sb;
+}
+
+/*
+ * Fill a bitmap block: bits [0, nr_used[ are used (0), bits [nr_used, nr_bits[
+ * are free (1) and bits past nr_bits do not exist (0).
+ */
+static void fill_bitmap_block(uint64_t *bitmap, uint32_t first_bit,
+			      uint32_t nr_used, uint32_t nr_bits)
+{
+	uint32_t i, bit;
+
+	memset(bitmap, 0, OUICHEFS_BLOCK_SIZE);
+	for (i = 0; i < OUICHEFS_BLOCK_SIZE * 8; i++) {
+		bit = first_bit + i;
+		if (bit >= nr_used && bit < nr_bits)
+			bitmap[i / 64] |= 1ULL << (i % 64);
+	}
+	for (i = 0; i < OUICHEFS_BLOCK_SIZE / 8; i++)
+		bitmap[i] = htole64(bitmap[i]);
+}
+
+static int write_group(int fd, struct ouichefs_superblock *sb, uint32_t g)
+{
+	uint32_t bpg = le32toh(sb->blocks_per_group);
+	uint32_t ipg = le32toh(sb->inodes_per_group);
+	uint32_t nr_istore = le32toh(sb->nr_istore_blocks);
+	uint32_t nr_ifree = le32toh(sb->nr_ifree_blocks);
+	uint32_t nr_bfree = le32toh(sb->nr_bfree_blocks);
+	uint32_t nr_meta = 1 + nr_istore + nr_ifree + nr_bfree;
+	uint32_t nr_blocks = le32toh(sb->nr_blocks) - g * bpg;
+	struct ouichefs_inode *inode;
+	char *block;
+	uint32_t i;
+	int ret = -1;
+
+	if (nr_blocks > bpg)
+		nr_blocks = bpg;
+
+	block = malloc(OUICHEFS_BLOCK_SIZE);
+	if (!block)
+		return -1;
+
+	if (lseek(fd, (off_t)g * bpg * OUICHEFS_BLOCK_SIZE, SEEK_SET) < 0)
+		goto end;
+
+	/* Superblock, or its backup copy */
+	if (write(fd, sb, OUICHEFS_BLOCK_SIZE) != OUICHEFS_BLOCK_SIZE)
+		goto end;
+
+	/* Inode store, with the root inode (inode 1) in group 0 */
+	for (i = 0; i < nr_istore; i++) {
+		memset(block, 0, OUICHEFS_BLOCK_SIZE);
+		if (g == 0 && i == 0) {
+			inode = (struct ouichefs_inode *)(block +
+				inode_size(le32toh(sb->features)));
+			inode->i_mode = htole32(S_IFDIR | S_IRUSR | S_IRGRP |
+						S_IROTH | S_IWUSR | S_IWGRP |
+						S_IXUSR | S_IXGRP | S_IXOTH);
+			inode->i_size = htole32(OUICHEFS_BLOCK_SIZE);
+			inode->i_blocks = htole32(1);
+			inode->i_nlink = htole32(2);
+			inode->index_block = htole32(nr_meta);
+		}
+		if (write(fd, block, OUICHEFS_BLOCK_SIZE) != OUICHEFS_BLOCK_SIZE)
+			goto end;
+	}
+
+	/* Inode bitmap: first inode of the group reserved, root inode used */
+	for (i = 0; i < nr_ifree; i++) {
+		fill_bitmap_block((uint64_t *)block, i * OUICHEFS_BLOCK_SIZE * 8,
+				  g == 0 ? 2 : 1, ipg);
+		if (write(fd, block, OUICHEFS_BLOCK_SIZE) != OUICHEFS_BLOCK_SIZE)
+			goto end;
+	}
+
+	/* Block bitmap: metadata used, root index block used */
+	for (i = 0; i < nr_bfree; i++) {
+		fill_bitmap_block((uint64_t *)block, i * OUICHEFS_BLOCK_SIZE * 8,
+				  g == 0 ? nr_meta + 1 : nr_meta, nr_blocks);
+		if (write(fd, block, OUICHEFS_BLOCK_SIZE) != OUICHEFS_BLOCK_SIZE)
+			goto end;
+	}
+
+	/* Root index block */
+	if (g == 0) {
+		memset(block, 0, OUICHEFS_BLOCK_SIZE);
+		if (write(fd, block, OUICHEFS_BLOCK_SIZE) != OUICHEFS_BLOCK_SIZE)
+			goto end;
+	}
+	ret = 0;
+
+end:
+	free(block);
+	return ret;
+}
+
+static int write_groups(int fd, struct ouichefs_superblock *sb)
+{
+	uint32_t g;
+
+	for (g = 0; g < le32toh(sb->nr_groups); g++) {
+		if (write_group(fd, sb, g))
+			return -1;
+	}
+	printf("Allocation groups: wrote %u groups\n", g);
+
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	int ret = EXIT_SUCCESS, fd;
 	long int min_size;
 	struct stat stat_buf;
 	struct ouichefs_superblock *sb = NULL;
-
-	if (argc != 2 || argv[1][0] == '-') {
+	uint32_t features = 0;
+	int groups = 0, opt;
+
+	while ((opt = getopt(argc, argv, "gel")) != -1) {
+		switch (opt) {
+		case 'g':
+			groups = 1;
+			break;
+		case 'e':
+			features |= OUICHEFS_FEATURE_EXTENTS;
+			break;
+		case 'l':
+			features |= OUICHEFS_FEATURE_LARGE_INODES;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind != argc - 1) {
 		usage(argv[0]);
 		return EXIT_FAILURE;
 	}
 
 	/* Open disk image */
-	fd = open(argv[1], O_RDWR);
+	fd = open(argv[optind], O_RDWR);
 	if (fd == -1) {
 		perror("open():");
 		return EXIT_FAILURE;
@@ -371,8 +615,18 @@ int main(int argc, char **argv)
 		goto fclose;
 	}
 
+	/* Write allocation groups */
+	if (groups) {
+		sb = init_groups_superblock(&stat_buf, features);
+		if (!sb || write_groups(fd, sb)) {
+			perror("write_groups()");
+			ret = EXIT_FAILURE;
+		}
+		goto free_sb;
+	}
+
 	/* Write superblock (block 0) */
-	sb = write_superblock(fd, &stat_buf);
+	sb = write_superblock(fd, &stat_buf, features);
 	if (!sb) {
 		perror("write_superblock():");
 		ret = EXIT_FAILURE;
@@ -8,13 +8,20 @@
 #define _OUICHEFS_H
 
 #include <linux/fs.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/percpu_counter.h>
+#include <linux/shrinker.h>
+#include <linux/xarray.h>
 
 #define OUICHEFS_MAGIC 0x48434957
 
 #define OUICHEFS_SB_BLOCK_NR 0
 
 #define OUICHEFS_BLOCK_SIZE (1 << 12) /* 4 KiB */
-#define OUICHEFS_MAX_FILESIZE (1 << 22) /* 4 MiB */
+#define OUICHEFS_MAX_FILESIZE (1 << 22) /* 4 MiB, in insert mode */
 #define OUICHEFS_FILENAME_LEN 28
 #define OUICHEFS_MAX_SUBFILES 128
 
@@ -34,7 +41,33 @@
  * |      blocks   |  rest of the blocks
  * +---------------+
  *
+ * With allocation groups (sb->nr_groups != 0), the partition is split into
+ * groups of sb->blocks_per_group blocks (the last one may be shorter), each
+ * laid out as above with its own slice of the inodes (sb->inodes_per_group
+ * inodes per group). The first block of a group holds the superblock for group
+ * 0 and a backup copy written by mkfs for the other groups. The nr_*_blocks
+ * fields of the superblock are then per group. Inode numbers and block numbers
+ * stay global: inode ino belongs to group ino / inodes_per_group and block bno
+ * to group bno / blocks_per_group. The first inode of each group is never used.
+ *
+ * +---------------+---------------+-----+---------------+
+ * |    group 0    |    group 1    | ... |  group n - 1  |
+ * +---------------+---------------+-----+---------------+
+ */
+
+/*
+ * With large inodes, a regular file has no index block as long as its block
+ * map fits in i_direct: OUICHEFS_NR_DIRECT block numbers in the flat format,
+ * or OUICHEFS_INLINE_EXTENTS extents in the extent format.
+ */
+#define OUICHEFS_NR_DIRECT 12
+#define OUICHEFS_INLINE_EXTENTS 3
+
+/*
+ * With large inodes, regular files of at most OUICHEFS_INLINE_SIZE bytes keep
+ * their data in the inode (OUICHEFS_INODE_INLINE), in place of i_direct.
  */
+#define OUICHEFS_INLINE_SIZE 176
 
 struct ouichefs_inode {
 	uint32_t i_mode; /* File mode */
@@ -42,25 +75,87 @@ struct ouichefs_inode {
 	uint32_t i_gid; /* Group id */
 	uint32_t i_size; /* Size in bytes */
 	uint32_t i_ctime; /* Inode change time (sec)*/
+	uint32_t i_size_high; /* Size in bytes (high 32 bits) */
 	uint64_t i_nctime; /* Inode change time (nsec) */
 	uint32_t i_atime; /* Access time (sec) */
+	uint32_t i_dind_block; /* Double indirect block of the block map */
 	uint64_t i_natime; /* Access time (nsec) */
 	uint32_t i_mtime; /* Modification time (sec) */
+	uint32_t i_tind_block; /* Triple indirect block of the block map */
 	uint64_t i_nmtime; /* Modification time (nsec) */
 	uint32_t i_blocks; /* Block count */
 	uint32_t i_nlink; /* Hard links count */
 	uint32_t index_block; /* Block with list of blocks for this file */
+	uint32_t i_flags; /* OUICHEFS_INODE_* flags, in former tail padding */
+
+	/* Large inodes only (OUICHEFS_FEATURE_LARGE_INODES) */
+	union {
+		/* Block map, without index block */
+		uint32_t i_direct[OUICHEFS_NR_DIRECT];
+		/* Data of inline files */
+		char i_inline[OUICHEFS_INLINE_SIZE];
+	};
 };
 
+/* On-disk inode size without OUICHEFS_FEATURE_LARGE_INODES */
+#define OUICHEFS_SMALL_INODE_SIZE offsetof(struct ouichefs_inode, i_direct)
+
+/* The index block of the file holds extents (struct ouichefs_extent_block) */
+#define OUICHEFS_INODE_EXTENTS 0x1
+/* The data of the file is in the inode (i_inline), without any block */
+#define OUICHEFS_INODE_INLINE 0x2
+
+/*
+ * The flat block map of a file in normal mode has up to three ranges: the index
+ * block maps the first OUICHEFS_PTRS blocks of the file, the double indirect
+ * block the next OUICHEFS_PTRS^2 blocks and the triple indirect block the next
+ * OUICHEFS_PTRS^3 blocks (about 4 TiB in total).
+ */
+#define OUICHEFS_PTRS_BITS 10
+#define OUICHEFS_PTRS (1U << OUICHEFS_PTRS_BITS) /* Block numbers per block */
+#define OUICHEFS_DIND_BLOCKS (1U << (2 * OUICHEFS_PTRS_BITS))
+#define OUICHEFS_TIND_BLOCKS (1U << (3 * OUICHEFS_PTRS_BITS))
+#define OUICHEFS_MAP_BLOCKS \
+	(OUICHEFS_PTRS + OUICHEFS_DIND_BLOCKS + OUICHEFS_TIND_BLOCKS)
+#define OUICHEFS_MAX_BYTES ((loff_t)OUICHEFS_MAP_BLOCKS * OUICHEFS_BLOCK_SIZE)
+
 struct ouichefs_inode_info {
-	uint32_t index_block;
+	uint32_t index_block; /* 0 if the block map is in i_direct */
+	union {
+		/* Block map, without index block */
+		uint32_t i_direct[OUICHEFS_NR_DIRECT];
+		/* Data of inline files (OUICHEFS_INODE_INLINE) */
+		char i_inline[OUICHEFS_INLINE_SIZE];
+	};
+	uint32_t dind_block; /* Double indirect block, 0 if none */
+	uint32_t tind_block; /* Triple indirect block, 0 if none */
+	uint32_t i_flags; /* OUICHEFS_INODE_* flags */
+	struct rw_semaphore map_sem; /* Protects the block map of the file */
+
+	spinlock_t map_cache_lock; /* Protects the cached leaf */
+	uint32_t map_cache_leaf; /* Last leaf block looked up, 0 if none */
+	sector_t map_cache_base; /* First file block mapped by that leaf */
+
+	void *index_cache; /* Copy of the index block, NULL if not cached */
+	uint32_t *insert_sums; /* Fenwick tree of the insert mode sizes */
+	bool index_cache_ref; /* Looked up since the last shrinker scan */
+	struct list_head index_cache_list; /* Entry in sbi->index_cache_inodes */
+
+	struct xarray delayed; /* Reserved file blocks, allocated at writeback */
+
+	spinlock_t prealloc_lock; /* Protects the preallocation window */
+	uint32_t prealloc_start; /* First block of the preallocation window */
+	uint32_t prealloc_len; /* Number of blocks left in the window */
+	struct list_head prealloc_list; /* Entry in sbi->prealloc_inodes */
+
+	spinlock_t ioend_lock; /* Protects ioend_list */
+	struct list_head ioend_list; /* Written unwritten ioends to convert */
+	struct work_struct ioend_work; /* Converts the ioends of ioend_list */
+
 	struct inode vfs_inode;
 };
 
-#define OUICHEFS_INODES_PER_BLOCK \
-	(OUICHEFS_BLOCK_SIZE / sizeof(struct ouichefs_inode))
-
-struct ouichefs_sb_info {
+struct ouichefs_superblock {
 	uint32_t magic; /* Magic number */
 
 	uint32_t nr_blocks; /* Total number of blocks (incl sb & inodes) */
@@ -73,14 +168,194 @@ struct ouichefs_sb_info {
 	uint32_t nr_free_inodes; /* Number of free inodes */
 	uint32_t nr_free_blocks; /* Number of free blocks */
 
+	uint32_t nr_groups; /* Number of allocation groups, 0 if none */
+	uint32_t blocks_per_group; /* Number of blocks per group */
+	uint32_t inodes_per_group; /* Number of inodes per group */
+
+	uint32_t features; /* OUICHEFS_FEATURE_* flags */
+};
+
+/* New regular files use the extent index format */
+#define OUICHEFS_FEATURE_EXTENTS 0x1
+/* Inodes are sizeof(struct ouichefs_inode) bytes, with i_direct */
+#define OUICHEFS_FEATURE_LARGE_INODES 0x2
+#define OUICHEFS_FEATURES_SUPPORTED \
+	(OUICHEFS_FEATURE_EXTENTS | OUICHEFS_FEATURE_LARGE_INODES)
+
+/*
+ * A run of free blocks, linked in the free extent tree both by start block and
+ * by length.
+ */
+struct ouichefs_fext {
+	struct rb_node by_start;
+	struct rb_node by_len;
+	uint32_t start; /* First free block */
+	uint32_t len; /* Number of free blocks */
+};
+
+struct ouichefs_fext_tree {
+	struct rb_root by_start; /* Free extents sorted by start block */
+	struct rb_root by_len; /* Free extents sorted by length */
+	uint32_t nr_extents; /* Number of free extents */
+	bool valid; /* False if the tree is not in sync with bfree_bitmap */
+};
+
+/*
+ * Two-level summary of an in-memory free bitmap, used to find free bits
+ * without scanning the whole bitmap (see bitmap.h).
+ */
+struct ouichefs_bitmap_sum {
+	unsigned long *l1; /* One bit per word of the bitmap */
+	unsigned long *l2; /* One bit per word of l1 */
+	unsigned long cursor; /* Roving cursor: where the next search starts */
+};
+
+/*
+ * In-memory allocation group. Without allocation groups on disk, the whole
+ * partition is a single group. The bitmaps of a group are slices of the
+ * global in-memory bitmaps, indexed from the first inode/block of the group.
+ */
+struct ouichefs_group {
+	spinlock_t ialloc_lock; /* Protects ifree_bitmap and its summary */
+	spinlock_t balloc_lock; /* Protects bfree_bitmap, its summary & fext */
+
+	uint32_t first_inode; /* First inode of the group */
+	uint32_t nr_inodes; /* Number of inodes of the group */
+	uint32_t first_block; /* First block of the group */
+	uint32_t nr_blocks; /* Number of blocks of the group */
+
+	uint32_t istore_block; /* First inode store block */
+	uint32_t ifree_block; /* First inode free bitmap block */
+	uint32_t bfree_block; /* First block free bitmap block */
+
+	uint32_t nr_free_inodes; /* Free inodes in ifree_bitmap */
+	uint32_t nr_free_blocks; /* Free blocks in bfree_bitmap */
+
+	unsigned long *ifree_bitmap; /* Free inodes bitmap of the group */
+	unsigned long *bfree_bitmap; /* Free blocks bitmap of the group */
+
+	struct ouichefs_bitmap_sum ifree_sum; /* Summary of ifree_bitmap */
+	struct ouichefs_bitmap_sum bfree_sum; /* Summary of bfree_bitmap */
+
+	struct ouichefs_fext_tree fext; /* In-memory free extent tree */
+};
+
+/*
+ * Contiguous blocks claimed from the block bitmap by a CPU and not yet
+ * allocated to a file (see balloc.c).
+ */
+struct ouichefs_balloc_batch {
+	spinlock_t lock;
+	uint32_t start; /* First block of the batch */
+	uint32_t len; /* Number of blocks left in the batch */
+};
+
+struct ouichefs_sb_info {
+	uint32_t magic; /* Magic number */
+
+	uint32_t nr_blocks; /* Total number of blocks (incl sb & inodes) */
+	uint32_t nr_inodes; /* Total number of inodes */
+
+	uint32_t nr_istore_blocks; /* Number of inode store blocks */
+	uint32_t nr_ifree_blocks; /* Number of inode free bitmap blocks */
+	uint32_t nr_bfree_blocks; /* Number of block free bitmap blocks */
+
+	struct percpu_counter nr_free_inodes; /* Number of free inodes */
+	struct percpu_counter nr_free_blocks; /* Number of free blocks */
+	struct percpu_counter nr_dirty_blocks; /* Blocks reserved by delalloc */
+
+	struct ouichefs_balloc_batch __percpu *batches; /* Per-CPU batches */
+
+	spinlock_t prealloc_lock; /* Protects prealloc_inodes */
+	struct list_head prealloc_inodes; /* Inodes with a prealloc window */
+	struct percpu_counter prealloc_hits; /* Allocations from a window */
+	struct percpu_counter prealloc_misses; /* Allocations of a window */
+	struct percpu_counter ra_hits; /* Unbuffered reads found in memory */
+	struct percpu_counter ra_misses; /* Unbuffered reads from the disk */
+
+	spinlock_t index_cache_lock; /* Protects index_cache_inodes */
+	struct list_head index_cache_inodes; /* Inodes with a cached index */
+	unsigned long nr_index_cached; /* Length of index_cache_inodes */
+	struct shrinker index_shrinker; /* Frees the cached index blocks */
+
 	unsigned long *ifree_bitmap; /* In-memory free inodes bitmap */
 	unsigned long *bfree_bitmap; /* In-memory free blocks bitmap */
+
+	uint32_t nr_groups; /* Number of groups (1 without groups on disk) */
+	uint32_t blocks_per_group; /* Number of blocks per group */
+	uint32_t inodes_per_group; /* Number of inodes per group */
+	struct ouichefs_group *groups; /* In-memory allocation groups */
+
+	uint32_t features; /* OUICHEFS_FEATURE_* flags */
+	uint32_t inode_size; /* Size of an on-disk inode */
+	uint32_t inodes_per_block; /* Inodes per inode store block */
 };
 
+static inline struct ouichefs_group *
+ouichefs_ino_group(struct ouichefs_sb_info *sbi, uint32_t ino)
+{
+	return &sbi->groups[ino / sbi->inodes_per_group];
+}
+
+static inline struct ouichefs_group *
+ouichefs_block_group(struct ouichefs_sb_info *sbi, uint32_t bno)
+{
+	return &sbi->groups[bno / sbi->blocks_per_group];
+}
+
+/*
+ * Return the inode store block containing inode ino, and store the offset of
+ * the inode in this block, in bytes, in offset.
+ */
+static inline uint32_t ouichefs_inode_block(struct ouichefs_sb_info *sbi,
+					    uint32_t ino, uint32_t *offset)
+{
+	struct ouichefs_group *grp = ouichefs_ino_group(sbi, ino);
+
+	*offset = (ino - grp->first_inode) % sbi->inodes_per_block *
+		  sbi->inode_size;
+	return grp->istore_block +
+	       (ino - grp->first_inode) / sbi->inodes_per_block;
+}
+
+/*
+ * In normal mode, an index entry with this bit set points to a block that was
+ * preallocated by fallocate() but never written: it reads as zeroes and the
+ * bit is cleared on the first write to the block.
+ */
+#define OUICHEFS_UNWRITTEN 0x80000000
+
 struct ouichefs_file_index_block {
 	uint32_t blocks[OUICHEFS_BLOCK_SIZE >> 2];
 };
 
+/* Return the block number stored in a normal mode index entry */
+static inline uint32_t ouichefs_index_bno(uint32_t entry)
+{
+	return entry & ~OUICHEFS_UNWRITTEN;
+}
+
+/*
+ * Extent index format: the index block holds nr_extents extents, sorted by
+ * logical block and not overlapping. Logical blocks covered by no extent are
+ * holes. As in the flat format, OUICHEFS_UNWRITTEN is set in ee_start for
+ * preallocated blocks that were never written.
+ */
+struct ouichefs_extent {
+	uint32_t ee_block; /* First logical block of the extent */
+	uint32_t ee_start; /* First physical block of the extent */
+	uint32_t ee_len; /* Number of blocks of the extent */
+};
+
+#define OUICHEFS_MAX_EXTENTS                        \
+	((OUICHEFS_BLOCK_SIZE - sizeof(uint32_t)) / \
+	 sizeof(struct ouichefs_extent))
+
+struct ouichefs_extent_block {
+	uint32_t nr_extents;
+	struct ouichefs_extent extents[OUICHEFS_MAX_EXTENTS];
+};
+
 struct ouichefs_dir_block {
 	struct ouichefs_file {
 		uint32_t inode;
@@ -91,12 +366,82 @@ struct ouichefs_dir_block {
 /* superblock functions */
 int ouichefs_fill_super(struct super_block *sb, void *data, int silent);
 
+/* inode and block allocator functions */
+int ouichefs_balloc_init(struct ouichefs_sb_info *sbi, uint32_t nr_free_inodes,
+			 uint32_t nr_free_blocks);
+void ouichefs_balloc_destroy(struct ouichefs_sb_info *sbi);
+void ouichefs_balloc_drain(struct ouichefs_sb_info *sbi);
+uint32_t ouichefs_balloc_batched(struct ouichefs_sb_info *sbi,
+				 uint32_t *largest);
+uint32_t get_free_inode(struct ouichefs_sb_info *sbi, uint32_t dir,
+			bool is_dir);
+void put_inode(struct ouichefs_sb_info *sbi, uint32_t ino);
+uint32_t get_free_blocks(struct ouichefs_sb_info *sbi, uint32_t goal,
+			 uint32_t count, uint32_t *got);
+void put_block(struct ouichefs_sb_info *sbi, uint32_t bno);
+uint32_t get_free_file_blocks(struct inode *inode, uint32_t goal,
+			      uint32_t count, uint32_t *got);
+void ouichefs_prealloc_init(struct inode *inode);
+void ouichefs_prealloc_discard(struct inode *inode);
+void ouichefs_prealloc_drain(struct ouichefs_sb_info *sbi);
+int ouichefs_reserve_blocks(struct ouichefs_sb_info *sbi, uint32_t count);
+void ouichefs_release_blocks(struct ouichefs_sb_info *sbi, uint32_t count);
+uint32_t ouichefs_avail_blocks(struct ouichefs_sb_info *sbi);
+int ouichefs_bitmap_sum_init(struct ouichefs_bitmap_sum *sum,
+			     unsigned long *freemap, unsigned long size);
+void ouichefs_bitmap_sum_destroy(struct ouichefs_bitmap_sum *sum);
+int ouichefs_groups_init(struct ouichefs_sb_info *sbi);
+void ouichefs_groups_destroy(struct ouichefs_sb_info *sbi);
+int ouichefs_fext_build(struct ouichefs_group *grp);
+void ouichefs_fext_destroy(struct ouichefs_group *grp);
+uint32_t ouichefs_fext_alloc(struct ouichefs_group *grp, uint32_t goal,
+			     uint32_t count, uint32_t *got);
+void ouichefs_fext_free(struct ouichefs_group *grp, uint32_t start,
+			uint32_t len);
+uint32_t ouichefs_fext_largest(struct ouichefs_group *grp);
+
 /* inode functions */
 int ouichefs_init_inode_cache(void);
 void ouichefs_destroy_inode_cache(void);
 struct inode *ouichefs_iget(struct super_block *sb, unsigned long ino);
 
+/* block map functions */
+struct buffer_head;
+int ouichefs_map_lookup(struct inode *inode, sector_t iblock, uint32_t max,
+			uint32_t *entry, uint32_t *len);
+int ouichefs_map_set(struct inode *inode, sector_t iblock, uint32_t entry,
+		     uint32_t len);
+uint32_t ouichefs_map_goal(struct inode *inode, sector_t iblock);
+int ouichefs_map_alloc(struct inode *inode, sector_t first, sector_t last,
+		       uint32_t flags);
+int ouichefs_map_convert(struct inode *inode, sector_t first, sector_t last);
+int ouichefs_ext_room(struct inode *inode);
+int ouichefs_map_truncate(struct inode *inode, bool scrub);
+void ouichefs_map_cache_init(struct inode *inode);
+int ouichefs_map_add_index(struct inode *inode);
+int ouichefs_map_uninline(struct inode *inode);
+void *ouichefs_index_cache_get(struct inode *inode, struct buffer_head **bh);
+void ouichefs_index_cache_update(struct inode *inode, const void *index);
+void ouichefs_index_cache_drop(struct inode *inode);
+const uint32_t *ouichefs_insert_sums_get(struct inode *inode);
+uint32_t ouichefs_insert_sums_prefix(const uint32_t *sums, uint32_t n);
+uint32_t ouichefs_insert_sums_find(const uint32_t *sums, loff_t offset,
+				   uint32_t *sum);
+int ouichefs_index_cache_register(struct super_block *sb);
+void ouichefs_index_cache_unregister(struct ouichefs_sb_info *sbi);
+uint32_t ouichefs_delayed_run(struct inode *inode, sector_t iblock,
+			      uint32_t max);
+int ouichefs_delayed_reserve(struct inode *inode, sector_t iblock,
+			     uint32_t max);
+uint32_t ouichefs_delayed_release(struct inode *inode, sector_t first,
+				  sector_t last);
+
 /* file functions */
+void ouichefs_ioend_init(struct inode *inode);
+ssize_t ouichefs_read_insert(struct file *file, char __user *data, size_t len,
+			     loff_t *pos);
+int ouichefs_ra_init(struct ouichefs_sb_info *sbi);
+void ouichefs_ra_destroy(struct ouichefs_sb_info *sbi);
 extern struct file_operations ouichefs_file_ops;
 extern const struct file_operations ouichefs_dir_ops;
 extern const struct address_space_operations ouichefs_aops;
@@ -106,4 +451,40 @@ extern const struct address_space_operations ouichefs_aops;
 #define OUICHEFS_INODE(inode) \
 	(container_of(inode, struct ouichefs_inode_info, vfs_inode))
 
+static inline bool ouichefs_has_extents(struct inode *inode)
+{
+	return OUICHEFS_INODE(inode)->i_flags & OUICHEFS_INODE_EXTENTS;
+}
+
+/* Stable with ci->map_sem held, a hint otherwise */
+static inline bool ouichefs_is_inline(struct inode *inode)
+{
+	return OUICHEFS_INODE(inode)->i_flags & OUICHEFS_INODE_INLINE;
+}
+
+/*
+ * Insert mode only handles flat files that fit in their index block. Other
+ * files always use the normal read/write functions (insert writes first give
+ * an index block to flat files without one).
+ */
+static inline bool ouichefs_insert_capable(struct inode *inode)
+{
+	struct ouichefs_inode_info *ci = OUICHEFS_INODE(inode);
+
+	return !ouichefs_has_extents(inode) && ci->index_block &&
+	       !ci->dind_block && !ci->tind_block &&
+	       inode->i_size <= OUICHEFS_MAX_FILESIZE;
+}
+
+/*
+ * Whether the data of the file is laid out in insert mode: the filesystem is
+ * in insert mode (see SWITCH_MODE) and the file can be handled by it. Files
+ * that are insert capable in normal mode use the normal (iomap) layout.
+ */
+static inline bool ouichefs_insert_mode(struct inode *inode)
+{
+	return inode->i_fop && inode->i_fop->read == ouichefs_read_insert &&
+	       ouichefs_insert_capable(inode);
+}
+
 #endif /* _OUICHEFS_H */
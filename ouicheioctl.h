@@ -21,4 +21,18 @@
 /*
  * DISPLAY_MODE: diplay the current read/write mode
  */
-#define DISPLAY_MODE		_IOR(IO_MAGIC, 3, char *)
\ No newline at end of file
+#define DISPLAY_MODE		_IOR(IO_MAGIC, 3, char *)
+/*
+ * STATS: return statistics about the file system of the file
+ */
+struct ouichefs_stats {
+	uint32_t nr_free_blocks; /* Number of free blocks */
+	uint32_t nr_free_extents; /* Number of free extents (0 if no tree) */
+	uint32_t largest_free_extent; /* Largest free extent, in blocks */
+	uint64_t nr_prealloc_hits; /* Allocations served by a prealloc window */
+	uint64_t nr_prealloc_misses; /* Allocations that needed a new window */
+	uint64_t nr_ra_hits; /* Unbuffered reads of blocks already in memory */
+	uint64_t nr_ra_misses; /* Unbuffered reads that waited for the disk */
+};
+
+#define STATS			_IOR(IO_MAGIC, 4, struct ouichefs_stats)
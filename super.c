@@ -41,9 +41,27 @@ static struct inode *ouichefs_alloc_inode(struct super_block *sb)
 	if (!ci)
 		return NULL;
 	inode_init_once(&ci->vfs_inode);
+	init_rwsem(&ci->map_sem);
+	ouichefs_map_cache_init(&ci->vfs_inode);
+	ouichefs_prealloc_init(&ci->vfs_inode);
+	ouichefs_ioend_init(&ci->vfs_inode);
 	return &ci->vfs_inode;
 }
 
+static void ouichefs_evict_inode(struct inode *inode)
+{
+	truncate_inode_pages_final(&inode->i_data);
+	/* The writeback of the last ioend may still be running */
+	flush_work(&OUICHEFS_INODE(inode)->ioend_work);
+	ouichefs_prealloc_discard(inode);
+	ouichefs_index_cache_drop(inode);
+	/* Delayed blocks whose data was dropped without being written back */
+	ouichefs_delayed_release(inode, 0, OUICHEFS_MAP_BLOCKS - 1);
+	/* Buffers dirtied by insert writes (see ouichefs_write_insert()) */
+	invalidate_inode_buffers(inode);
+	clear_inode(inode);
+}
+
 static void ouichefs_destroy_inode(struct inode *inode)
 {
 	struct ouichefs_inode_info *ci;
@@ -61,23 +79,23 @@ static int ouichefs_write_inode(struct inode *inode,
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 	struct buffer_head *bh;
 	uint32_t ino = inode->i_ino;
-	uint32_t inode_block = (ino / OUICHEFS_INODES_PER_BLOCK) + 1;
-	uint32_t inode_shift = ino % OUICHEFS_INODES_PER_BLOCK;
+	uint32_t inode_block, inode_offset;
 
 	if (ino >= sbi->nr_inodes)
 		return 0;
+	inode_block = ouichefs_inode_block(sbi, ino, &inode_offset);
 
 	bh = sb_bread(sb, inode_block);
 	if (!bh)
 		return -EIO;
-	disk_inode = (struct ouichefs_inode *)bh->b_data;
-	disk_inode += inode_shift;
+	disk_inode = (struct ouichefs_inode *)(bh->b_data + inode_offset);
 
 	/* update the mode using what the generic inode has */
 	disk_inode->i_mode = inode->i_mode;
 	disk_inode->i_uid = i_uid_read(inode);
 	disk_inode->i_gid = i_gid_read(inode);
 	disk_inode->i_size = inode->i_size;
+	disk_inode->i_size_high = inode->i_size >> 32;
 	disk_inode->i_ctime = inode->i_ctime.tv_sec;
 	disk_inode->i_nctime = inode->i_ctime.tv_nsec;
 	disk_inode->i_atime = inode->i_atime.tv_sec;
@@ -87,6 +105,15 @@ static int ouichefs_write_inode(struct inode *inode,
 	disk_inode->i_blocks = inode->i_blocks;
 	disk_inode->i_nlink = inode->i_nlink;
 	disk_inode->index_block = ci->index_block;
+	disk_inode->i_dind_block = ci->dind_block;
+	disk_inode->i_tind_block = ci->tind_block;
+	disk_inode->i_flags = ci->i_flags;
+	/* Small inodes end before i_direct */
+	if (sbi->features & OUICHEFS_FEATURE_LARGE_INODES) {
+		/* Either the block map or the inline data */
+		memcpy(disk_inode->i_inline, ci->i_inline,
+		       sizeof(disk_inode->i_inline));
+	}
 
 	mark_buffer_dirty(bh);
 	sync_dirty_buffer(bh);
@@ -98,22 +125,24 @@ static int ouichefs_write_inode(struct inode *inode,
 static int sync_sb_info(struct super_block *sb, int wait)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
-	struct ouichefs_sb_info *disk_sb;
+	struct ouichefs_superblock *disk_sb;
 	struct buffer_head *bh;
 
 	/* Flush superblock */
 	bh = sb_bread(sb, 0);
 	if (!bh)
 		return -EIO;
-	disk_sb = (struct ouichefs_sb_info *)bh->b_data;
+	disk_sb = (struct ouichefs_superblock *)bh->b_data;
 
 	disk_sb->nr_blocks = sbi->nr_blocks;
 	disk_sb->nr_inodes = sbi->nr_inodes;
 	disk_sb->nr_istore_blocks = sbi->nr_istore_blocks;
 	disk_sb->nr_ifree_blocks = sbi->nr_ifree_blocks;
 	disk_sb->nr_bfree_blocks = sbi->nr_bfree_blocks;
-	disk_sb->nr_free_inodes = sbi->nr_free_inodes;
-	disk_sb->nr_free_blocks = sbi->nr_free_blocks;
+	disk_sb->nr_free_inodes =
+		percpu_counter_sum_positive(&sbi->nr_free_inodes);
+	disk_sb->nr_free_blocks =
+		percpu_counter_sum_positive(&sbi->nr_free_blocks);
 
 	mark_buffer_dirty(bh);
 	if (wait)
@@ -123,50 +152,52 @@ static int sync_sb_info(struct super_block *sb, int wait)
 	return 0;
 }
 
-static int sync_ifree(struct super_block *sb, int wait)
+/*
+ * Read the nr_bits bits of an in-memory bitmap from the consecutive blocks
+ * starting at block.
+ */
+static int read_bitmap(struct super_block *sb, uint32_t block,
+		       unsigned long *map, uint32_t nr_bits)
 {
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t size = DIV_ROUND_UP(nr_bits, 8), len, i;
 	struct buffer_head *bh;
-	int i, idx;
 
-	/* Flush free inodes bitmask */
-	for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-		idx = sbi->nr_istore_blocks + i + 1;
-
-		bh = sb_bread(sb, idx);
+	for (i = 0; i * OUICHEFS_BLOCK_SIZE < size; i++) {
+		bh = sb_bread(sb, block + i);
 		if (!bh)
 			return -EIO;
 
-		memcpy(bh->b_data,
-		       (void *)sbi->ifree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       OUICHEFS_BLOCK_SIZE);
+		len = min_t(uint32_t, size - i * OUICHEFS_BLOCK_SIZE,
+			    OUICHEFS_BLOCK_SIZE);
+		memcpy((void *)map + i * OUICHEFS_BLOCK_SIZE, bh->b_data, len);
 
-		mark_buffer_dirty(bh);
-		if (wait)
-			sync_dirty_buffer(bh);
 		brelse(bh);
 	}
 
 	return 0;
 }
 
-static int sync_bfree(struct super_block *sb, int wait)
+/*
+ * Write the nr_bits bits of an in-memory bitmap, protected by lock, to the
+ * consecutive blocks starting at block.
+ */
+static int write_bitmap(struct super_block *sb, uint32_t block,
+			unsigned long *map, uint32_t nr_bits, spinlock_t *lock,
+			int wait)
 {
-	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	uint32_t size = DIV_ROUND_UP(nr_bits, 8), len, i;
 	struct buffer_head *bh;
-	int i, idx;
-
-	/* Flush free blocks bitmask */
-	for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-		idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
 
-		bh = sb_bread(sb, idx);
+	for (i = 0; i * OUICHEFS_BLOCK_SIZE < size; i++) {
+		bh = sb_bread(sb, block + i);
 		if (!bh)
 			return -EIO;
 
-		memcpy(bh->b_data,
-		       (void *)sbi->bfree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       OUICHEFS_BLOCK_SIZE);
+		len = min_t(uint32_t, size - i * OUICHEFS_BLOCK_SIZE,
+			    OUICHEFS_BLOCK_SIZE);
+		spin_lock(lock);
+		memcpy(bh->b_data, (void *)map + i * OUICHEFS_BLOCK_SIZE, len);
+		spin_unlock(lock);
 
 		mark_buffer_dirty(bh);
 		if (wait)
@@ -177,13 +208,56 @@ static int sync_bfree(struct super_block *sb, int wait)
 	return 0;
 }
 
+static int sync_ifree(struct super_block *sb, int wait)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_group *grp;
+	int ret;
+	uint32_t g;
+
+	/* Flush free inodes bitmask of each group */
+	for (g = 0; g < sbi->nr_groups; g++) {
+		grp = &sbi->groups[g];
+		ret = write_bitmap(sb, grp->ifree_block, grp->ifree_bitmap,
+				   grp->nr_inodes, &grp->ialloc_lock, wait);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int sync_bfree(struct super_block *sb, int wait)
+{
+	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
+	struct ouichefs_group *grp;
+	int ret;
+	uint32_t g;
+
+	/* Flush free blocks bitmask of each group */
+	for (g = 0; g < sbi->nr_groups; g++) {
+		grp = &sbi->groups[g];
+		ret = write_bitmap(sb, grp->bfree_block, grp->bfree_bitmap,
+				   grp->nr_blocks, &grp->balloc_lock, wait);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
 static void ouichefs_put_super(struct super_block *sb)
 {
 	struct ouichefs_sb_info *sbi = OUICHEFS_SB(sb);
 
 	if (sbi) {
+		ouichefs_ra_destroy(sbi);
+		ouichefs_index_cache_unregister(sbi);
+		ouichefs_groups_destroy(sbi);
+		kfree(sbi->groups);
 		kfree(sbi->ifree_bitmap);
 		kfree(sbi->bfree_bitmap);
+		ouichefs_balloc_destroy(sbi);
 		kfree(sbi);
 	}
 }
@@ -192,6 +266,10 @@ static int ouichefs_sync_fs(struct super_block *sb, int wait)
 {
 	int ret = 0;
 
+	/* Blocks held in batches and preallocation windows are free on disk */
+	ouichefs_balloc_drain(OUICHEFS_SB(sb));
+	ouichefs_prealloc_drain(OUICHEFS_SB(sb));
+
 	ret = sync_sb_info(sb, wait);
 	if (ret)
 		return ret;
@@ -213,10 +291,10 @@ static int ouichefs_statfs(struct dentry *dentry, struct kstatfs *stat)
 	stat->f_type = OUICHEFS_MAGIC;
 	stat->f_bsize = OUICHEFS_BLOCK_SIZE;
 	stat->f_blocks = sbi->nr_blocks;
-	stat->f_bfree = sbi->nr_free_blocks;
-	stat->f_bavail = sbi->nr_free_blocks;
+	stat->f_bfree = ouichefs_avail_blocks(sbi);
+	stat->f_bavail = stat->f_bfree;
 	stat->f_files = sbi->nr_inodes;
-	stat->f_ffree = sbi->nr_free_inodes;
+	stat->f_ffree = percpu_counter_sum_positive(&sbi->nr_free_inodes);
 	stat->f_namelen = OUICHEFS_FILENAME_LEN;
 
 	return 0;
@@ -226,24 +304,91 @@ static struct super_operations ouichefs_super_ops = {
 	.put_super = ouichefs_put_super,
 	.alloc_inode = ouichefs_alloc_inode,
 	.destroy_inode = ouichefs_destroy_inode,
+	.evict_inode = ouichefs_evict_inode,
 	.write_inode = ouichefs_write_inode,
 	.sync_fs = ouichefs_sync_fs,
 	.statfs = ouichefs_statfs,
 };
 
+/*
+ * Check the allocation group geometry of the superblock and set up the
+ * in-memory groups. Without allocation groups on disk, the whole partition is
+ * a single group.
+ */
+static int setup_groups(struct ouichefs_sb_info *sbi,
+			struct ouichefs_superblock *csb)
+{
+	struct ouichefs_group *grp;
+	uint32_t g, start;
+
+	if (csb->nr_groups) {
+		if (!csb->blocks_per_group || !csb->inodes_per_group ||
+		    csb->blocks_per_group % 64 || csb->inodes_per_group % 64 ||
+		    csb->nr_groups != DIV_ROUND_UP(csb->nr_blocks,
+						   csb->blocks_per_group) ||
+		    csb->nr_inodes != csb->nr_groups * csb->inodes_per_group ||
+		    csb->nr_bfree_blocks * OUICHEFS_BLOCK_SIZE * 8 <
+			    csb->blocks_per_group ||
+		    csb->nr_ifree_blocks * OUICHEFS_BLOCK_SIZE * 8 <
+			    csb->inodes_per_group ||
+		    csb->nr_blocks - (csb->nr_groups - 1) * csb->blocks_per_group <=
+			    1 + csb->nr_istore_blocks + csb->nr_ifree_blocks +
+				    csb->nr_bfree_blocks) {
+			pr_err("Invalid allocation groups\n");
+			return -EINVAL;
+		}
+		sbi->nr_groups = csb->nr_groups;
+		sbi->blocks_per_group = csb->blocks_per_group;
+		sbi->inodes_per_group = csb->inodes_per_group;
+	} else {
+		sbi->nr_groups = 1;
+		sbi->blocks_per_group = sbi->nr_blocks;
+		sbi->inodes_per_group = sbi->nr_inodes;
+	}
+
+	sbi->groups = kcalloc(sbi->nr_groups, sizeof(struct ouichefs_group),
+			      GFP_KERNEL);
+	if (!sbi->groups)
+		return -ENOMEM;
+
+	for (g = 0; g < sbi->nr_groups; g++) {
+		grp = &sbi->groups[g];
+		start = g * sbi->blocks_per_group;
+
+		grp->first_inode = g * sbi->inodes_per_group;
+		grp->nr_inodes = sbi->inodes_per_group;
+		grp->first_block = start;
+		grp->nr_blocks =
+			min(sbi->blocks_per_group, sbi->nr_blocks - start);
+
+		grp->istore_block = start + 1;
+		grp->ifree_block = grp->istore_block + sbi->nr_istore_blocks;
+		grp->bfree_block = grp->ifree_block + sbi->nr_ifree_blocks;
+
+		grp->ifree_bitmap =
+			sbi->ifree_bitmap + BIT_WORD(grp->first_inode);
+		grp->bfree_bitmap =
+			sbi->bfree_bitmap + BIT_WORD(grp->first_block);
+	}
+
+	return 0;
+}
+
 /* Fill the struct superblock from partition superblock */
 int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct buffer_head *bh = NULL;
-	struct ouichefs_sb_info *csb = NULL;
+	struct ouichefs_superblock *csb = NULL;
 	struct ouichefs_sb_info *sbi = NULL;
+	struct ouichefs_group *grp;
 	struct inode *root_inode = NULL;
-	int ret = 0, i;
+	int ret = 0;
+	uint32_t g;
 
 	/* Init sb */
 	sb->s_magic = OUICHEFS_MAGIC;
 	sb_set_blocksize(sb, OUICHEFS_BLOCK_SIZE);
-	sb->s_maxbytes = OUICHEFS_MAX_FILESIZE;
+	sb->s_maxbytes = OUICHEFS_MAX_BYTES;
 	sb->s_op = &ouichefs_super_ops;
 	sb->s_time_gran = 1;
 
@@ -251,7 +396,7 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	bh = sb_bread(sb, OUICHEFS_SB_BLOCK_NR);
 	if (!bh)
 		return -EIO;
-	csb = (struct ouichefs_sb_info *)bh->b_data;
+	csb = (struct ouichefs_superblock *)bh->b_data;
 
 	/* Check magic number */
 	if (csb->magic != sb->s_magic) {
@@ -260,6 +405,13 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 		goto release;
 	}
 
+	if (csb->features & ~OUICHEFS_FEATURES_SUPPORTED) {
+		pr_err("Unsupported features 0x%x\n",
+		       csb->features & ~OUICHEFS_FEATURES_SUPPORTED);
+		ret = -EINVAL;
+		goto release;
+	}
+
 	/* Alloc sb_info */
 	sbi = kzalloc(sizeof(struct ouichefs_sb_info), GFP_KERNEL);
 	if (!sbi) {
@@ -271,79 +423,99 @@ int ouichefs_fill_super(struct super_block *sb, void *data, int silent)
 	sbi->nr_istore_blocks = csb->nr_istore_blocks;
 	sbi->nr_ifree_blocks = csb->nr_ifree_blocks;
 	sbi->nr_bfree_blocks = csb->nr_bfree_blocks;
-	sbi->nr_free_inodes = csb->nr_free_inodes;
-	sbi->nr_free_blocks = csb->nr_free_blocks;
+	sbi->features = csb->features;
+	if (sbi->features & OUICHEFS_FEATURE_LARGE_INODES)
+		sbi->inode_size = sizeof(struct ouichefs_inode);
+	else
+		sbi->inode_size = OUICHEFS_SMALL_INODE_SIZE;
+	sbi->inodes_per_block = OUICHEFS_BLOCK_SIZE / sbi->inode_size;
+	ret = ouichefs_balloc_init(sbi, csb->nr_free_inodes,
+				   csb->nr_free_blocks);
+	if (ret) {
+		kfree(sbi);
+		goto release;
+	}
 	sb->s_fs_info = sbi;
 
-	brelse(bh);
-
-	/* Alloc and copy ifree_bitmap */
-	sbi->ifree_bitmap =
-		kzalloc(sbi->nr_ifree_blocks * OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
+	/* Alloc in-memory bitmaps, groups use slices of them */
+	sbi->ifree_bitmap = kcalloc(BITS_TO_LONGS(sbi->nr_inodes),
+				    sizeof(unsigned long), GFP_KERNEL);
 	if (!sbi->ifree_bitmap) {
 		ret = -ENOMEM;
-		goto free_sbi;
+		goto free_balloc;
 	}
-	for (i = 0; i < sbi->nr_ifree_blocks; i++) {
-		int idx = sbi->nr_istore_blocks + i + 1;
-
-		bh = sb_bread(sb, idx);
-		if (!bh) {
-			ret = -EIO;
-			goto free_ifree;
-		}
-
-		memcpy((void *)sbi->ifree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       bh->b_data, OUICHEFS_BLOCK_SIZE);
-
-		brelse(bh);
-	}
-
-	/* Alloc and copy bfree_bitmap */
-	sbi->bfree_bitmap =
-		kzalloc(sbi->nr_bfree_blocks * OUICHEFS_BLOCK_SIZE, GFP_KERNEL);
+	sbi->bfree_bitmap = kcalloc(BITS_TO_LONGS(sbi->nr_blocks),
+				    sizeof(unsigned long), GFP_KERNEL);
 	if (!sbi->bfree_bitmap) {
 		ret = -ENOMEM;
 		goto free_ifree;
 	}
-	for (i = 0; i < sbi->nr_bfree_blocks; i++) {
-		int idx = sbi->nr_istore_blocks + sbi->nr_ifree_blocks + i + 1;
-
-		bh = sb_bread(sb, idx);
-		if (!bh) {
-			ret = -EIO;
-			goto free_bfree;
-		}
 
-		memcpy((void *)sbi->bfree_bitmap + i * OUICHEFS_BLOCK_SIZE,
-		       bh->b_data, OUICHEFS_BLOCK_SIZE);
+	/* Set up allocation groups */
+	ret = setup_groups(sbi, csb);
+	if (ret)
+		goto free_bfree;
 
-		brelse(bh);
+	brelse(bh);
+	bh = NULL;
+
+	/* Copy ifree_bitmap and bfree_bitmap of each group */
+	for (g = 0; g < sbi->nr_groups; g++) {
+		grp = &sbi->groups[g];
+		ret = read_bitmap(sb, grp->ifree_block, grp->ifree_bitmap,
+				  grp->nr_inodes);
+		if (ret)
+			goto free_groups;
+		ret = read_bitmap(sb, grp->bfree_block, grp->bfree_bitmap,
+				  grp->nr_blocks);
+		if (ret)
+			goto free_groups;
 	}
 
+	/* Build the summaries and free extent trees of the groups */
+	ret = ouichefs_groups_init(sbi);
+	if (ret)
+		goto free_groups;
+
+	ret = ouichefs_index_cache_register(sb);
+	if (ret)
+		goto destroy_groups;
+
+	ret = ouichefs_ra_init(sbi);
+	if (ret)
+		goto unregister_cache;
+
 	/* Create root inode */
 	root_inode = ouichefs_iget(sb, 1);
 	if (IS_ERR(root_inode)) {
 		ret = PTR_ERR(root_inode);
-		goto free_bfree;
+		goto destroy_ra;
 	}
 	inode_init_owner(&nop_mnt_idmap, root_inode, NULL, root_inode->i_mode);
 	sb->s_root = d_make_root(root_inode);
 	if (!sb->s_root) {
 		ret = -ENOMEM;
-		goto iput;
+		goto destroy_ra;
 	}
 
 	return 0;
 
-iput:
-	iput(root_inode);
+destroy_ra:
+	ouichefs_ra_destroy(sbi);
+unregister_cache:
+	ouichefs_index_cache_unregister(sbi);
+destroy_groups:
+	ouichefs_groups_destroy(sbi);
+free_groups:
+	kfree(sbi->groups);
 free_bfree:
 	kfree(sbi->bfree_bitmap);
 free_ifree:
 	kfree(sbi->ifree_bitmap);
-free_sbi:
+free_balloc:
+	ouichefs_balloc_destroy(sbi);
 	kfree(sbi);
+	sb->s_fs_info = NULL;
 release:
 	brelse(bh);
 
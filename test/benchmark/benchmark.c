@@ -8,6 +8,7 @@
 #include <time.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #define BEGIN 0
 #define END 1
@@ -22,6 +23,8 @@
 #define READTEXT \
 	"Lorem ipsum dolor sit amet, consectetur adipiscing elit. Donec finibus neque eu sem maximus euismod. Class aptent taciti sociosqu ad litora torquent per conubia nostra"
 #define CLOCKS_PER_MQ (CLOCKS_PER_SEC / 1000000)
+#define NBTHREADS 4
+#define NBWRTHREAD 256
 /*
  * affiche un buffer complet : ainsi que tous les caractères non imprimable
  */
@@ -578,6 +581,81 @@ int test_all(const char *src_rep)
 	duplication_test(tmp, path, 1);
 }
 
+struct thread_arg {
+	char path[MAX_BUFF];
+	int written;
+};
+
+/*
+ * ecrit NBWRTHREAD blocs, un par un, dans le fichier du thread
+ */
+void *write_thread(void *arg)
+{
+	struct thread_arg *targ = arg;
+	char buff[OFFSET1];
+	int src_fd = open(targ->path, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+
+	targ->written = 0;
+	if (src_fd < 0) {
+		fprintf(stdout, "Fichier non_existant %s\n", targ->path);
+		return NULL;
+	}
+
+	memset(buff, 't', OFFSET1);
+	for (int i = 0; i < NBWRTHREAD; i++) {
+		int ret = write(src_fd, buff, OFFSET1 - 1);
+
+		if (ret <= 0)
+			break;
+		targ->written += ret;
+	}
+
+	close(src_fd);
+	return NULL;
+}
+
+/*
+ * nb_threads threads ecrivent en parallele dans des fichiers differents du
+ * dossier src_rep, pour mesurer la contention sur l'allocateur de blocs
+ */
+int parallel_write_test(const char *src_rep, int nb_threads)
+{
+	if (nb_threads <= 0)
+		nb_threads = NBTHREADS;
+
+	pthread_t threads[nb_threads];
+	struct thread_arg args[nb_threads];
+	struct timespec begin, end;
+	long total = 0;
+
+	printf("===== TEST WRITE PARALLELE (%d threads)\n", nb_threads);
+
+	for (int i = 0; i < nb_threads; i++)
+		snprintf(args[i].path, MAX_BUFF, "%s/parallelwrite%d.txt",
+			 src_rep, i);
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (int i = 0; i < nb_threads; i++) {
+		if (pthread_create(&threads[i], NULL, write_thread, &args[i])) {
+			fprintf(stderr, "%s: pthread_create failed\n",
+				__func__);
+			nb_threads = i;
+			break;
+		}
+	}
+	for (int i = 0; i < nb_threads; i++) {
+		pthread_join(threads[i], NULL);
+		total += args[i].written;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("Write parallele: ecriture: %ld octets | attendu: %ld octets | time: %ld micro_sec\n",
+	       total, (long)nb_threads * NBWRTHREAD * (OFFSET1 - 1),
+	       (end.tv_sec - begin.tv_sec) * 1000000 +
+		       (end.tv_nsec - begin.tv_nsec) / 1000);
+	return total;
+}
+
 int toParam(const char *param)
 {
 	if (strcmp("-d", param) == 0)
@@ -613,6 +691,9 @@ int toParam(const char *param)
 	if (strcmp("-wb", param) == 0)
 		return 11;
 
+	if (strcmp("-t", param) == 0)
+		return 12;
+
 	return 0;
 }
 
@@ -624,6 +705,8 @@ int main(int argc, char **argv)
 			"-d : duplication\n-r :read\n-w :write append\n-ws :write at the start\n-wm :write in the middle\n-wa :write in a new\n");
 		fprintf(stdout, "-wo :write with an offset\n");
 		fprintf(stdout, "-wb :write multiple blocks\n");
+		fprintf(stdout,
+			"-t <path_to_directory> [nb_threads] :parallel writes\n");
 		fprintf(stdout, "-A <path_to_directory> :all the test\n");
 		fprintf(stdout,
 			"-i :insertion |to be used with the classic write\n");
@@ -737,12 +820,23 @@ int main(int argc, char **argv)
 			write_big(argv[2], 1);
 			break;
 		}
+	case 12:
+		/*
+		 * ecritures en parallele dans plusieurs fichiers
+		 */
+		if (argc >= 3) {
+			parallel_write_test(argv[2], argc > 3 ? atoi(argv[3]) :
+								NBTHREADS);
+			break;
+		}
 	default:
 		fprintf(stdout, "Usage: benchmark <option> <path_>\n");
 		fprintf(stdout,
 			"-d : duplication\n-r :read\n-w :write append\n-ws :write at the start\n-wm :write in the middle\n-wa :write in a new\n");
 		fprintf(stdout, "-wo :write with an offset\n");
 		fprintf(stdout, "-wb :write multiple blocks\n");
+		fprintf(stdout,
+			"-t <path_to_directory> [nb_threads] :parallel writes\n");
 		fprintf(stdout, "-A <path_to_directory> :all the test\n");
 		fprintf(stdout,
 			"-i :insertion |to be used with the classic write\n");
@@ -18,6 +18,7 @@ int main(int argc, char **argv)
 		printf("\t-d : defragment the file\n");
 		printf("\t-s : switch the read/write mode for the file system of the file\n");
 		printf("\t-w : display current read/write mode for the file system of the file\n");
+		printf("\t-a : display allocator statistics for the file system of the file\n");
 		return 1;
 	}
 
@@ -30,6 +31,7 @@ int main(int argc, char **argv)
 
 	// int32_t val;
 	char val[64];
+	struct ouichefs_stats stats;
 
 	switch (argv[1][1]) {
 	case 'i':
@@ -52,6 +54,34 @@ int main(int argc, char **argv)
 		else
 			perror("ioctl");
 		break;
+	case 'a':
+		if (ioctl(fd, STATS, &stats) != 0) {
+			perror("ioctl");
+			break;
+		}
+		printf("Free blocks: %u\n", stats.nr_free_blocks);
+		printf("Free extents: %u\n", stats.nr_free_extents);
+		printf("Largest free extent: %u blocks\n",
+		       stats.largest_free_extent);
+		printf("Preallocation hits: %llu/%llu (%.1f%%)\n",
+		       (unsigned long long)stats.nr_prealloc_hits,
+		       (unsigned long long)(stats.nr_prealloc_hits +
+					    stats.nr_prealloc_misses),
+		       stats.nr_prealloc_hits + stats.nr_prealloc_misses ?
+			       100.0 * stats.nr_prealloc_hits /
+				       (stats.nr_prealloc_hits +
+					stats.nr_prealloc_misses) :
+			       0.0);
+		printf("Readahead hits: %llu/%llu (%.1f%%)\n",
+		       (unsigned long long)stats.nr_ra_hits,
+		       (unsigned long long)(stats.nr_ra_hits +
+					    stats.nr_ra_misses),
+		       stats.nr_ra_hits + stats.nr_ra_misses ?
+			       100.0 * stats.nr_ra_hits /
+				       (stats.nr_ra_hits +
+					stats.nr_ra_misses) :
+			       0.0);
+		break;
 	default:
 		printf("Invalid option\n");
 		break;